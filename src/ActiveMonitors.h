@@ -9,10 +9,32 @@
 
 
 
+// Filters are indexed under every value of their ids, authors, and tag fields. For each event, the
+// values in the event are looked up, and each hit sets the bit for that field in the filter's mask.
+// A filter matches once all of its fields have been hit, so only filters that match on every
+// indexed field are visited more than once, and doesMatch is never called.
+//
+// kinds are usually much less selective than the other fields (think {"authors":[X], "kinds":[1]}),
+// so they are only indexed for filters that have no other fields, and are otherwise checked after
+// the indexed fields have matched.
+
 struct ActiveMonitors : NonCopyable {
   private:
+    struct Monitor;
+
+    struct FilterMonitor {
+        Monitor *mon;
+        const NostrFilter *f;
+        uint64_t requiredMask = 0; // one bit per indexed field
+        uint64_t currMask = 0; // fields hit so far by event currEventId
+        uint64_t currEventId = 0;
+        bool checkKinds = false; // kinds is present but not indexed
+        bool checkTags = false; // too many tags to index them all
+    };
+
     struct Monitor : NonCopyable {
         Subscription sub;
+        std::vector<FilterMonitor> filterMonitors; // one per filter, never resized after install since MonitorSets point into it
 
         Monitor(Subscription &sub_) : sub(std::move(sub_)) {}
         Monitor(const Monitor&) = delete; // pointers to filters inside sub must be stable because they are stored in MonitorSets
@@ -21,20 +43,57 @@ struct ActiveMonitors : NonCopyable {
     using ConnMonitor = std::unordered_map<SubId, Monitor>;
     flat_hash_map<uint64_t, ConnMonitor> conns; // connId -> subId -> Monitor
 
-    struct MonitorItem {
-        Monitor *mon;
-        uint64_t latestEventId;
+    static const uint64_t IDS_BIT = 1ULL << 0;
+    static const uint64_t AUTHORS_BIT = 1ULL << 1;
+    static const uint64_t KINDS_BIT = 1ULL << 2;
+    static const uint64_t FIRST_TAG_BIT = 3;
+    static const uint64_t MAX_INDEXED_TAGS = 64 - FIRST_TAG_BIT;
+
+    using MonitorSet = flat_hash_map<FilterMonitor*, uint64_t>; // -> bit for the field this set is indexing
+
+    // ids and authors can be prefixes. Prefixes of an event's value are found with one lookup for
+    // each distinct prefix length in use (normally only full-length values).
+    struct PrefixIndex {
+        btree_map<std::string, MonitorSet, std::less<>> sets;
+        std::map<size_t, uint64_t> lengths; // prefix length -> number of keys in sets with this length
+
+        MonitorSet &install(const std::string &key) {
+            auto res = sets.try_emplace(key);
+            if (res.second) lengths[key.size()]++;
+            return res.first->second;
+        }
+
+        void uninstall(const std::string &key, FilterMonitor *fm) {
+            auto it = sets.find(key);
+            it->second.erase(fm);
+            if (!it->second.empty()) return;
+
+            sets.erase(it);
+            if (--lengths[key.size()] == 0) lengths.erase(key.size());
+        }
+
+        template<typename F>
+        void foreachMatch(std::string_view val, F cb) {
+            for (const auto &[len, count] : lengths) {
+                if (len > val.size()) break;
+
+                auto it = sets.find(val.substr(0, len));
+                if (it != sets.end()) cb(it->second);
+            }
+        }
     };
 
-    using MonitorSet = flat_hash_map<NostrFilter*, MonitorItem>;
-    btree_map<std::string, MonitorSet> allIds;
-    btree_map<std::string, MonitorSet> allAuthors;
-    btree_map<std::string, MonitorSet> allTags;
+    PrefixIndex allIds;
+    PrefixIndex allAuthors;
+    btree_map<std::string, MonitorSet, std::less<>> allTags;
     btree_map<uint64_t, MonitorSet> allKinds;
-    MonitorSet allOthers;
+    flat_hash_set<FilterMonitor*> allOthers;
 
+    EventTagIndex evTags;
+
+    // Reused so that looking up an event's tags doesn't allocate (once the buffer has grown to the longest tag)
     std::string tagSpecBuf = std::string(256, '\0');
-    const std::string &getTagSpec(uint8_t k, std::string_view val) {
+    std::string_view getTagSpec(uint8_t k, std::string_view val) {
         tagSpecBuf.clear();
         tagSpecBuf += (char)k;
         tagSpecBuf += val;
@@ -61,7 +120,7 @@ struct ActiveMonitors : NonCopyable {
         auto subId = sub.subId;
         auto *m = &connMonitors.try_emplace(subId, sub).first->second;
 
-        installLookups(m, currEventId);
+        installLookups(m);
         return true;
     }
 
@@ -84,87 +143,70 @@ struct ActiveMonitors : NonCopyable {
         conns.erase(connId);
     }
 
-    void process(lmdb::txn &txn, defaultDb::environment::View_Event &ev, std::function<void(RecipientList &&, uint64_t)> cb) {
+    // cb(RecipientList &&recipients, uint64_t levId) is called if any subs match
+
+    template<typename F>
+    void process(uint64_t levId, const NostrIndex::Event *flat, F cb) {
         RecipientList recipients;
 
-        auto processMonitorSet = [&](MonitorSet &ms){
-            for (auto &[f, item] : ms) {
-                if (item.latestEventId >= ev.primaryKeyId || item.mon->sub.latestEventId >= ev.primaryKeyId) continue;
-                item.latestEventId = ev.primaryKeyId;
-
-                if (f->doesMatch(ev.flat_nested())) {
-                    recipients.emplace_back(item.mon->sub.connId, item.mon->sub.subId);
-                    item.mon->sub.latestEventId = ev.primaryKeyId;
-                    continue;
-                }
-            }
-        };
+        bool tagsBuilt = false;
+
+        auto matched = [&](FilterMonitor *fm){
+            const auto *f = fm->f;
 
-        auto processMonitorsPrefix = [&](btree_map<std::string, MonitorSet> &m, const std::string &key, std::function<bool(const std::string&)> matches){
-            auto it = m.lower_bound(key.substr(0, 1));
+            if (!f->doesMatchTimes(flat->created_at())) return;
+            if (fm->checkKinds && !f->kinds->doesMatch(flat->kind())) return;
 
-            if (it == m.end()) return;
+            if (fm->checkTags) {
+                if (!tagsBuilt) {
+                    evTags.build(flat);
+                    tagsBuilt = true;
+                }
 
-            while (it != m.end() && it->first[0] == key[0]) {
-                if (matches(it->first)) processMonitorSet(it->second);
-                it = std::next(it);
+                if (!f->doesMatchTags(evTags)) return;
             }
+
+            auto &sub = fm->mon->sub;
+            if (sub.latestEventId >= levId) return; // too old, or already matched by another filter in this sub
+
+            recipients.emplace_back(sub.connId, sub.subId);
+            sub.latestEventId = levId;
         };
 
-        auto processMonitorsExact = [&]<typename T>(btree_map<T, MonitorSet> &m, const T &key, std::function<bool(const T &)> matches){
-            auto it = m.upper_bound(key);
+        auto processMonitorSet = [&](MonitorSet &ms){
+            for (auto &[fm, bit] : ms) {
+                if (fm->currEventId != levId) {
+                    fm->currEventId = levId;
+                    fm->currMask = 0;
+                }
 
-            if (it == m.begin()) return;
-            it = std::prev(it);
+                if (fm->currMask & bit) continue;
+                fm->currMask |= bit;
 
-            while (matches(it->first)) {
-                processMonitorSet(it->second);
-                if (it == m.begin()) break;
-                it = std::prev(it);
+                if (fm->currMask == fm->requiredMask) matched(fm);
             }
         };
 
-        auto *flat = ev.flat_nested();
-
-        {
-            auto id = std::string(sv(flat->id()));
-            processMonitorsPrefix(allIds, id, static_cast<std::function<bool(const std::string&)>>([&](const std::string &val){
-                return id.starts_with(val);
-            }));
-        }
-
-        {
-            auto pubkey = std::string(sv(flat->pubkey()));
-            processMonitorsPrefix(allAuthors, pubkey, static_cast<std::function<bool(const std::string&)>>([&](const std::string &val){
-                return pubkey.starts_with(val);
-            }));
-        }
+        allIds.foreachMatch(sv(flat->id()), processMonitorSet);
+        allAuthors.foreachMatch(sv(flat->pubkey()), processMonitorSet);
 
-        for (const auto &tag : *flat->tagsFixed32()) {
-            auto &tagSpec = getTagSpec(tag->key(), sv(tag->val()));
-            processMonitorsExact(allTags, tagSpec, static_cast<std::function<bool(const std::string&)>>([&](const std::string &val){
-                return tagSpec == val;
-            }));
-        }
+        auto processTag = [&](uint8_t k, std::string_view val){
+            auto it = allTags.find(getTagSpec(k, val));
+            if (it != allTags.end()) processMonitorSet(it->second);
+        };
 
-        for (const auto &tag : *flat->tagsGeneral()) {
-            auto &tagSpec = getTagSpec(tag->key(), sv(tag->val()));
-            processMonitorsExact(allTags, tagSpec, static_cast<std::function<bool(const std::string&)>>([&](const std::string &val){
-                return tagSpec == val;
-            }));
-        }
+        for (const auto &tag : *flat->tagsFixed32()) processTag(tag->key(), sv(tag->val()));
+        for (const auto &tag : *flat->tagsGeneral()) processTag(tag->key(), sv(tag->val()));
 
         {
-            auto kind = flat->kind();
-            processMonitorsExact(allKinds, kind, static_cast<std::function<bool(const uint64_t&)>>([&](const uint64_t &val){
-                return kind == val;
-            }));
+            auto it = allKinds.find(flat->kind());
+            if (it != allKinds.end()) processMonitorSet(it->second);
         }
 
-        processMonitorSet(allOthers);
+        for (auto *fm : allOthers) matched(fm);
 
         if (recipients.size()) {
-            cb(std::move(recipients), ev.primaryKeyId);
+            cb(std::move(recipients), levId);
         }
     }
 
@@ -180,69 +222,91 @@ struct ActiveMonitors : NonCopyable {
         return &f2->second;
     }
 
-    void installLookups(Monitor *m, uint64_t currEventId) {
+    // Calls cb(tagName, bit) for each of the filter's tags that is indexed
+    template<typename F>
+    static void foreachIndexedTag(const NostrFilter &f, F cb) {
+        std::vector<char> tagNames;
+        for (const auto &[tagName, filterSet] : f.tags) tagNames.push_back(tagName);
+        std::sort(tagNames.begin(), tagNames.end());
+
+        for (size_t i = 0; i < tagNames.size() && i < MAX_INDEXED_TAGS; i++) {
+            cb(tagNames[i], 1ULL << (FIRST_TAG_BIT + i));
+        }
+    }
+
+    void installLookups(Monitor *m) {
+        m->filterMonitors.reserve(m->sub.filterGroup.filters.size());
+
         for (auto &f : m->sub.filterGroup.filters) {
+            auto &fm = m->filterMonitors.emplace_back(FilterMonitor{ m, &f });
+
             if (f.ids) {
-                for (size_t i = 0; i < f.ids->size(); i++) {
-                    auto res = allIds.try_emplace(f.ids->at(i));
-                    res.first->second.try_emplace(&f, MonitorItem{m, currEventId});
-                }
-            } else if (f.authors) {
-                for (size_t i = 0; i < f.authors->size(); i++) {
-                    auto res = allAuthors.try_emplace(f.authors->at(i));
-                    res.first->second.try_emplace(&f, MonitorItem{m, currEventId});
-                }
-            } else if (f.tags.size()) {
-                for (const auto &[tagName, filterSet] : f.tags) {
-                    for (size_t i = 0; i < filterSet.size(); i++) {
-                        auto &tagSpec = getTagSpec(tagName, filterSet.at(i));
-                        auto res = allTags.try_emplace(tagSpec);
-                        res.first->second.try_emplace(&f, MonitorItem{m, currEventId});
-                    }
+                fm.requiredMask |= IDS_BIT;
+                for (size_t i = 0; i < f.ids->size(); i++) allIds.install(f.ids->at(i)).try_emplace(&fm, IDS_BIT);
+            }
+
+            if (f.authors) {
+                fm.requiredMask |= AUTHORS_BIT;
+                for (size_t i = 0; i < f.authors->size(); i++) allAuthors.install(f.authors->at(i)).try_emplace(&fm, AUTHORS_BIT);
+            }
+
+            foreachIndexedTag(f, [&](char tagName, uint64_t bit){
+                fm.requiredMask |= bit;
+                const auto &filterSet = f.tags.at(tagName);
+
+                for (size_t i = 0; i < filterSet.size(); i++) {
+                    allTags.try_emplace(std::string(getTagSpec(tagName, filterSet.at(i)))).first->second.try_emplace(&fm, bit);
                 }
-            } else if (f.kinds) {
-                for (size_t i = 0; i < f.kinds->size(); i++) {
-                    auto res = allKinds.try_emplace(f.kinds->at(i));
-                    res.first->second.try_emplace(&f, MonitorItem{m, currEventId});
+            });
+
+            fm.checkTags = f.tags.size() > MAX_INDEXED_TAGS;
+
+            if (f.kinds) {
+                if (fm.requiredMask) {
+                    fm.checkKinds = true;
+                } else {
+                    fm.requiredMask |= KINDS_BIT;
+                    for (size_t i = 0; i < f.kinds->size(); i++) allKinds.try_emplace(f.kinds->at(i)).first->second.try_emplace(&fm, KINDS_BIT);
                 }
-            } else {
-                allOthers.try_emplace(&f, MonitorItem{m, currEventId});
             }
+
+            if (!fm.requiredMask) allOthers.insert(&fm);
         }
     }
 
     void uninstallLookups(Monitor *m) {
-        for (auto &f : m->sub.filterGroup.filters) {
-            if (f.ids) {
-                for (size_t i = 0; i < f.ids->size(); i++) {
-                    auto &monSet = allIds.at(f.ids->at(i));
-                    monSet.erase(&f);
-                    if (monSet.empty()) allIds.erase(f.ids->at(i));
-                }
-            } else if (f.authors) {
-                for (size_t i = 0; i < f.authors->size(); i++) {
-                    auto &monSet = allAuthors.at(f.authors->at(i));
-                    monSet.erase(&f);
-                    if (monSet.empty()) allAuthors.erase(f.authors->at(i));
-                }
-            } else if (f.tags.size()) {
-                for (const auto &[tagName, filterSet] : f.tags) {
-                    for (size_t i = 0; i < filterSet.size(); i++) {
-                        auto &tagSpec = getTagSpec(tagName, filterSet.at(i));
-                        auto &monSet = allTags.at(tagSpec);
-                        monSet.erase(&f);
-                        if (monSet.empty()) allTags.erase(tagSpec);
-                    }
+        for (auto &fm : m->filterMonitors) {
+            const auto &f = *fm.f;
+
+            if (fm.requiredMask & IDS_BIT) {
+                for (size_t i = 0; i < f.ids->size(); i++) allIds.uninstall(f.ids->at(i), &fm);
+            }
+
+            if (fm.requiredMask & AUTHORS_BIT) {
+                for (size_t i = 0; i < f.authors->size(); i++) allAuthors.uninstall(f.authors->at(i), &fm);
+            }
+
+            foreachIndexedTag(f, [&](char tagName, uint64_t){
+                const auto &filterSet = f.tags.at(tagName);
+
+                for (size_t i = 0; i < filterSet.size(); i++) {
+                    auto it = allTags.find(getTagSpec(tagName, filterSet.at(i)));
+                    it->second.erase(&fm);
+                    if (it->second.empty()) allTags.erase(it);
                 }
-            } else if (f.kinds) {
+            });
+
+            if (fm.requiredMask & KINDS_BIT) {
                 for (size_t i = 0; i < f.kinds->size(); i++) {
                     auto &monSet = allKinds.at(f.kinds->at(i));
-                    monSet.erase(&f);
+                    monSet.erase(&fm);
                     if (monSet.empty()) allKinds.erase(f.kinds->at(i));
                 }
-            } else {
-                allOthers.erase(&f);
             }
+
+            if (!fm.requiredMask) allOthers.erase(&fm);
         }
+
+        m->filterMonitors.clear();
     }
 };
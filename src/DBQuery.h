@@ -5,43 +5,120 @@
 #include "Subscription.h"
 #include "filters.h"
 #include "events.h"
+#include "IndexStats.h"
+#include "ScanHelpers.h"
 
 
 struct DBScan : NonCopyable {
     struct CandidateEvent {
       private:
-        uint64_t packed;
         uint64_t levIdStorage;
+        uint64_t createdStorage;
 
       public:
-        CandidateEvent(uint64_t levId, uint64_t created, uint64_t scanIndex) : packed(scanIndex << 40 | created), levIdStorage(levId) {}
+        CandidateEvent(uint64_t levId, uint64_t created) : levIdStorage(levId), createdStorage(created) {}
 
-        uint64_t levId() { return levIdStorage; }
-        uint64_t created() { return packed & 0xFF'FFFFFFFF; }
-        uint64_t scanIndex() { return packed >> 40; }
+        uint64_t levId() const { return levIdStorage; }
+        uint64_t created() const { return createdStorage; }
     };
 
+    static bool candidateCmp(const CandidateEvent &a, const CandidateEvent &b) {
+        return a.created() == b.created() ? a.levId() > b.levId() : a.created() > b.created();
+    }
+
     enum class KeyMatchResult {
         Yes,
         No,
         NoButContinue,
     };
 
+    // Key matchers for each type of cursor. The cursor's prefix is stored in its IndexScan's
+    // prefix buffer and passed in, so that matchers don't need to own any memory.
+
+    struct PrefixMatcher { // ids and pubkeys, which may be partial
+        KeyMatchResult operator()(std::string_view k, std::string_view prefix) const {
+            return k.starts_with(prefix) ? KeyMatchResult::Yes : KeyMatchResult::No;
+        }
+    };
+
+    struct ExactMatcher { // prefix followed by created
+        KeyMatchResult operator()(std::string_view k, std::string_view prefix) const {
+            return k.size() == prefix.size() + 8 && k.starts_with(prefix) ? KeyMatchResult::Yes : KeyMatchResult::No;
+        }
+    };
+
+    struct PubkeyKindMatcher {
+        uint64_t kind;
+
+        KeyMatchResult operator()(std::string_view k, std::string_view prefix) const {
+            if (!k.starts_with(prefix)) return KeyMatchResult::No;
+            if (prefix.size() == 32 + 8) return KeyMatchResult::Yes;
+
+            ParsedKey_StringUint64Uint64 parsedKey(k);
+            if (parsedKey.n1 == kind) return KeyMatchResult::Yes;
+
+            // With a prefix pubkey, continue scanning (pubkey,kind) backwards because with this index
+            // we don't know the next pubkey to jump back to
+            return KeyMatchResult::NoButContinue;
+        }
+    };
+
+    struct KindMatcher {
+        uint64_t kind;
+
+        KeyMatchResult operator()(std::string_view k, std::string_view) const {
+            ParsedKey_Uint64Uint64 parsedKey(k);
+            return parsedKey.n1 == kind ? KeyMatchResult::Yes : KeyMatchResult::No;
+        }
+    };
+
+    struct AllMatcher {
+        KeyMatchResult operator()(std::string_view, std::string_view) const {
+            return KeyMatchResult::Yes;
+        }
+    };
+
+    using KeyMatcher = std::variant<PrefixMatcher, ExactMatcher, PubkeyKindMatcher, KindMatcher, AllMatcher>;
+
     struct ScanCursor {
         std::string resumeKey;
         uint64_t resumeVal;
-        std::function<KeyMatchResult(std::string_view)> keyMatch;
-        uint64_t outstanding = 0; // number of records remaining in eventQueue, decremented in DBScan::scan
+        KeyMatcher keyMatch;
+        uint32_t prefixOffset; // into IndexScan::prefixes
+        uint32_t prefixSize;
+        std::vector<CandidateEvent> buffer; // sorted descending by (created, levId)
+        size_t bufferPos = 0; // next candidate in buffer
 
         bool active() {
             return resumeKey.size() > 0;
         }
 
-        uint64_t collect(lmdb::txn &txn, DBScan &s, uint64_t scanIndex, uint64_t limit, std::deque<CandidateEvent> &output) {
-            uint64_t added = 0;
+        bool empty() const {
+            return bufferPos == buffer.size();
+        }
+
+        const CandidateEvent &head() const {
+            return buffer[bufferPos];
+        }
+
+        // Replaces the buffer with up to limit more candidates. The matcher type is resolved once
+        // per call, so matching each key doesn't go through an indirect call.
+
+        uint64_t collect(lmdb::txn &txn, const NostrFilter &f, lmdb::dbi indexDbi, std::string_view prefixes, uint64_t limit) {
+            std::string_view prefix = prefixes.substr(prefixOffset, prefixSize);
+
+            return std::visit([&](const auto &matcher){
+                return collectWith(txn, f, indexDbi, limit, [&](std::string_view k){ return matcher(k, prefix); });
+            }, keyMatch);
+        }
+
+        template<typename M>
+        uint64_t collectWith(lmdb::txn &txn, const NostrFilter &f, lmdb::dbi indexDbi, uint64_t limit, M keyMatch) {
+            buffer.clear();
+            bufferPos = 0;
 
             while (active() && limit > 0) {
-                bool finished = env.generic_foreachFull(txn, s.indexDbi, resumeKey, lmdb::to_sv<uint64_t>(resumeVal), [&](auto k, auto v) {
+                bool finished = env.generic_foreachFull(txn, indexDbi, resumeKey, lmdb::to_sv<uint64_t>(resumeVal), [&](auto k, auto v) {
                     if (limit == 0) {
                         resumeKey = std::string(k);
                         resumeVal = lmdb::from_sv<uint64_t>(v);
@@ -60,14 +137,14 @@ struct DBScan : NonCopyable {
                         ParsedKey_StringUint64 parsedKey(k);
                         created = parsedKey.n;
 
-                        if (s.f.since && created < s.f.since) {
+                        if (f.since && created < f.since) {
                             resumeKey = makeKey_StringUint64(parsedKey.s, 0);
                             resumeVal = 0;
                             return false;
                         }
 
-                        if (s.f.until && created > s.f.until) {
-                            resumeKey = makeKey_StringUint64(parsedKey.s, s.f.until);
+                        if (f.until && created > f.until) {
+                            resumeKey = makeKey_StringUint64(parsedKey.s, f.until);
                             resumeVal = MAX_U64;
                             return false;
                         }
@@ -75,8 +152,7 @@ struct DBScan : NonCopyable {
 
                     if (matched == KeyMatchResult::Yes) {
                         uint64_t levId = lmdb::from_sv<uint64_t>(v);
-                        output.emplace_back(levId, created, scanIndex);
-                        added++;
+                        buffer.emplace_back(levId, created);
                         limit--;
                     }
 
@@ -86,204 +162,572 @@ struct DBScan : NonCopyable {
                 if (finished) resumeKey = "";
             }
 
-            outstanding += added;
-            return added;
+            // Prefix cursors walk several keys, so their output is only sorted within each key
+            if (!std::is_sorted(buffer.begin(), buffer.end(), candidateCmp)) std::sort(buffer.begin(), buffer.end(), candidateCmp);
+
+            return buffer.size();
+        }
+
+        // Jump backwards so that nothing newer than created will be collected from the current key
+
+        void skipTo(uint64_t created) {
+            if (!active()) return;
+
+            ParsedKey_StringUint64 parsedKey(resumeKey);
+            if (parsedKey.n <= created) return;
+
+            resumeKey = makeKey_StringUint64(parsedKey.s, created);
+            resumeVal = MAX_U64;
         }
     };
 
+    // A set of cursors over a single index, merged into one stream sorted descending by (created, levId).
+    // Each cursor buffers a batch of candidates, and a heap of cursor indices ordered by their head
+    // candidates selects the next one, so popping costs O(log cursors) regardless of the buffer sizes.
+
+    struct IndexScan {
+        lmdb::dbi indexDbi;
+        const char *desc = "?";
+        std::vector<ScanCursor> cursors;
+        std::string prefixes; // the cursors' key prefixes, concatenated
+        std::vector<uint32_t> heap; // indices of cursors with buffered candidates, newest head at front
+        uint64_t initialScanDepth = 0;
+        uint64_t refillScanDepth = 0;
+        uint64_t nextInitIndex = 0;
+
+        void addCursor(std::string resumeKey, uint64_t resumeVal, KeyMatcher keyMatch, std::string_view prefix = "") {
+            cursors.emplace_back(ScanCursor{ std::move(resumeKey), resumeVal, keyMatch, (uint32_t)prefixes.size(), (uint32_t)prefix.size() });
+            prefixes += prefix;
+        }
+
+        void setDepths(uint64_t limit) {
+            initialScanDepth = std::clamp(limit / cursors.size(), uint64_t(5), uint64_t(50));
+            refillScanDepth = 10 * initialScanDepth;
+            heap.reserve(cursors.size());
+        }
+
+        bool initialised() {
+            return nextInitIndex == cursors.size();
+        }
+
+        bool empty() const {
+            return heap.empty();
+        }
+
+        const CandidateEvent &front() const {
+            return cursors[heap.front()].head();
+        }
+
+        uint64_t initStep(lmdb::txn &txn, const NostrFilter &f) {
+            uint64_t work = cursors[nextInitIndex].collect(txn, f, indexDbi, prefixes, initialScanDepth);
+            pushCursor(nextInitIndex);
+            nextInitIndex++;
+
+            return work;
+        }
+
+        // Removes the front candidate, refilling its cursor if it has nothing else buffered
+
+        uint64_t pop(lmdb::txn &txn, const NostrFilter &f) {
+            uint32_t index = popCursor();
+            auto &cursor = cursors[index];
+            uint64_t work = 0;
+
+            cursor.bufferPos++;
+            if (cursor.empty()) work = cursor.collect(txn, f, indexDbi, prefixes, refillScanDepth);
+
+            pushCursor(index);
+            return work;
+        }
+
+        // Discards all candidates newer than created. Cursors that run dry are repositioned
+        // with a seek instead of walking through the skipped records.
+
+        uint64_t skipTo(lmdb::txn &txn, const NostrFilter &f, uint64_t created) {
+            uint64_t work = 0;
+
+            while (heap.size() && front().created() > created) {
+                uint32_t index = popCursor();
+                auto &cursor = cursors[index];
+
+                while (!cursor.empty() && cursor.head().created() > created) cursor.bufferPos++;
+
+                if (cursor.empty()) {
+                    cursor.skipTo(created);
+                    work += 1 + cursor.collect(txn, f, indexDbi, prefixes, initialScanDepth);
+                }
+
+                pushCursor(index);
+            }
+
+            return work;
+        }
+
+      private:
+        bool heapCmp(uint32_t a, uint32_t b) const {
+            return candidateCmp(cursors[b].head(), cursors[a].head());
+        }
+
+        void pushCursor(uint32_t index) {
+            if (cursors[index].empty()) return;
+            heap.push_back(index);
+            std::push_heap(heap.begin(), heap.end(), [this](uint32_t a, uint32_t b){ return heapCmp(a, b); });
+        }
+
+        uint32_t popCursor() {
+            std::pop_heap(heap.begin(), heap.end(), [this](uint32_t a, uint32_t b){ return heapCmp(a, b); });
+            uint32_t index = heap.back();
+            heap.pop_back();
+            return index;
+        }
+    };
+
+    // A way of scanning for the fields of a filter that aren't yet covered by an index
+
+    struct AccessPath {
+        enum class Type {
+            TagKind,
+            Tag,
+            PubkeyKind,
+            Pubkey,
+            Kind,
+            CreatedAt,
+        };
+
+        Type type = Type::CreatedAt;
+        char tagName = '\0';
+        uint64_t cost = MAX_U64;
+    };
+
+    struct Coverage {
+        bool authors = false;
+        bool kinds = false;
+        flat_hash_set<char> tags;
+    };
+
+    // Upper bound on cursors in the second index of an intersection: each of them may need a seek per step
+    static const uint64_t MAX_INTERSECTION_CURSORS = 100;
+
+    // Number of keys looked up in IndexStats before extrapolating from the sample
+    static const uint64_t MAX_ESTIMATE_SAMPLES = 64;
+
+    // Assumed records per key when IndexStats can't tell (ie, prefix pubkeys)
+    static const uint64_t UNKNOWN_KEY_ESTIMATE = 100'000;
+
+    // Scans are only split into partitions that would each have at least this many cursors
+    static const uint64_t MIN_CURSORS_PER_PARTITION = 100;
+
     const NostrFilter &f;
     bool indexOnly;
-    lmdb::dbi indexDbi;
-    const char *desc = "?";
-    std::vector<ScanCursor> cursors;
-    std::deque<CandidateEvent> eventQueue; // sorted descending by created
-    uint64_t initialScanDepth;
-    uint64_t refillScanDepth;
-    uint64_t nextInitIndex = 0;
+    std::string desc;
+    uint64_t estimatedRecords = 0;
+    IndexScan primary;
+    std::optional<IndexScan> secondary; // if set, candidates must be found in both indices
     uint64_t approxWork = 0;
 
-    DBScan(const NostrFilter &f) : f(f) {
-        indexOnly = f.indexOnlyScans;
+    std::vector<uint64_t> intersectPrimary;
+    std::vector<uint64_t> intersectSecondary;
+    EventTagIndex evTags;
+    bool started = false;
+
+    DBScan(lmdb::txn &txn, const NostrFilter &f) : f(f) {
+        bool haveStats = IndexStats::ready(txn);
+        Coverage covered;
 
         if (f.ids) {
-            indexDbi = env.dbi_Event__id;
-            desc = "ID";
-
-            cursors.reserve(f.ids->size());
-            for (uint64_t i = 0; i < f.ids->size(); i++) {
-                std::string prefix = f.ids->at(i);
-
-                cursors.emplace_back(
-                    padBytes(prefix, 32 + 8, '\xFF'),
-                    MAX_U64,
-                    [prefix](std::string_view k){
-                        return k.starts_with(prefix) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
-            }
-        } else if (f.tags.size()) {
-            indexDbi = env.dbi_Event__tag;
-            desc = "Tag";
-
-            char tagName = '\0';
-            {
-                uint64_t numTags = MAX_U64;
-                for (const auto &[tn, filterSet] : f.tags) {
-                    if (filterSet.size() < numTags) {
-                        numTags = filterSet.size();
-                        tagName = tn;
-                    }
-                }
-            }
+            setupIdScan(primary);
+            indexOnly = f.indexOnlyScans;
+            desc = primary.desc;
+            primary.setDepths(f.limit);
+            return; // ids are already as selective as it gets, so they are never intersected
+        }
 
-            const auto &filterSet = f.tags.at(tagName);
+        bool primaryExact;
 
-            cursors.reserve(filterSet.size());
-            for (uint64_t i = 0; i < filterSet.size(); i++) {
-                std::string search;
-                search += tagName;
-                search += filterSet.at(i);
+        {
+            auto path = cheapestPath(txn, haveStats, covered);
+            setupPath(primary, path, covered);
+            estimatedRecords = path.cost;
+            primaryExact = isExactKeyPath(path);
+        }
 
-                cursors.emplace_back(
-                    search + std::string(8, '\xFF'),
-                    MAX_U64,
-                    [search](std::string_view k){
-                        return k.size() == search.size() + 8 && k.starts_with(search) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
-            }
-        } else if (f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000) {
-            indexDbi = env.dbi_Event__pubkeyKind;
-            desc = "PubkeyKind";
-
-            cursors.reserve(f.authors->size() * f.kinds->size());
-            for (uint64_t i = 0; i < f.authors->size(); i++) {
-                for (uint64_t j = 0; j < f.kinds->size(); j++) {
-                    uint64_t kind = f.kinds->at(j);
-
-                    std::string prefix = f.authors->at(i);
-                    if (prefix.size() == 32) prefix += lmdb::to_sv<uint64_t>(kind);
-
-                    cursors.emplace_back(
-                        padBytes(prefix, 32 + 8 + 8, '\xFF'),
-                        MAX_U64,
-                        [prefix, kind](std::string_view k){
-                            if (!k.starts_with(prefix)) return KeyMatchResult::No;
-                            if (prefix.size() == 32 + 8) return KeyMatchResult::Yes;
-
-                            ParsedKey_StringUint64Uint64 parsedKey(k);
-                            if (parsedKey.n1 == kind) return KeyMatchResult::Yes;
-
-                            // With a prefix pubkey, continue scanning (pubkey,kind) backwards because with this index
-                            // we don't know the next pubkey to jump back to
-                            return KeyMatchResult::NoButContinue;
-                        }
-                    );
-                }
-            }
-        } else if (f.authors) {
-            if (f.kinds) indexOnly = false; // because of the size limit in previous test
+        desc = primary.desc;
+        indexOnly = isCovered(covered);
 
-            indexDbi = env.dbi_Event__pubkey;
-            desc = "Pubkey";
+        // If the chosen index can't answer the filter by itself, try to intersect it with a second
+        // index so that events are only loaded from the Event table once both indices agree
 
-            cursors.reserve(f.authors->size());
-            for (uint64_t i = 0; i < f.authors->size(); i++) {
-                std::string prefix = f.authors->at(i);
+        if (!indexOnly && primaryExact) {
+            Coverage coveredWithOther = covered;
+            auto path = cheapestPath(txn, haveStats, coveredWithOther, true);
 
-                cursors.emplace_back(
-                    padBytes(prefix, 32 + 8, '\xFF'),
-                    MAX_U64,
-                    [prefix](std::string_view k){
-                        return k.starts_with(prefix) ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
-            }
-        } else if (f.kinds) {
-            indexDbi = env.dbi_Event__kind;
-            desc = "Kind";
-
-            cursors.reserve(f.kinds->size());
-            for (uint64_t i = 0; i < f.kinds->size(); i++) {
-                uint64_t kind = f.kinds->at(i);
-
-                cursors.emplace_back(
-                    std::string(lmdb::to_sv<uint64_t>(kind)) + std::string(8, '\xFF'),
-                    MAX_U64,
-                    [kind](std::string_view k){
-                        ParsedKey_Uint64Uint64 parsedKey(k);
-                        return parsedKey.n1 == kind ? KeyMatchResult::Yes : KeyMatchResult::No;
-                    }
-                );
-            }
-        } else {
-            indexDbi = env.dbi_Event__created_at;
-            desc = "CreatedAt";
-
-            cursors.reserve(1);
-            cursors.emplace_back(
-                std::string(8, '\xFF'),
-                MAX_U64,
-                [](std::string_view){
-                    return KeyMatchResult::Yes;
+            if (path.type != AccessPath::Type::CreatedAt) {
+                IndexScan other;
+                setupPath(other, path, coveredWithOther);
+
+                if (other.cursors.size() <= MAX_INTERSECTION_CURSORS) {
+                    desc += "+";
+                    desc += other.desc;
+                    secondary.emplace(std::move(other));
+                    secondary->setDepths(f.limit);
+
+                    indexOnly = isCovered(coveredWithOther);
                 }
-            );
+            }
         }
 
-        initialScanDepth = std::clamp(f.limit / cursors.size(), uint64_t(5), uint64_t(50));
-        refillScanDepth = 10 * initialScanDepth;
+        primary.setDepths(f.limit);
+    }
+
+    // Number of partitions this scan could be split into, at most maxPartitions. Only scans of a single
+    // index that haven't started yet can be split.
+
+    uint64_t numPartitions(uint64_t maxPartitions) const {
+        if (started || secondary) return 1;
+        return std::clamp(primary.cursors.size() / MIN_CURSORS_PER_PARTITION, uint64_t(1), maxPartitions);
     }
 
-    bool scan(lmdb::txn &txn, std::function<bool(uint64_t)> handleEvent, std::function<bool(uint64_t)> doPause) {
-        auto cmp = [](auto &a, auto &b){
-            return a.created() == b.created() ? a.levId() > b.levId() : a.created() > b.created();
+    // Scans of disjoint subsets of this scan's cursors, which can run concurrently in different threads
+    // and txns. The union of their results is this scan's results.
+
+    std::vector<std::unique_ptr<DBScan>> partition(uint64_t n) const {
+        std::vector<std::unique_ptr<DBScan>> output;
+        for (uint64_t i = 0; i < n; i++) output.emplace_back(new DBScan(*this, i, n));
+        return output;
+    }
+
+    // handleEvent(levId, created) returns true to stop the scan; doPause(approxWork) returns true to pause it
+
+    template<typename H, typename P>
+    bool scan(lmdb::txn &txn, H handleEvent, P doPause) {
+        started = true;
+
+        auto handleCandidate = [&](uint64_t levId, uint64_t created){
+            bool doSend = false;
+
+            if (indexOnly) {
+                if (f.doesMatchTimes(created)) doSend = true;
+            } else {
+                approxWork += 10;
+                auto *flat = lookupEventByLevId(txn, levId).flat_nested();
+                if (f.tags.size()) evTags.build(flat);
+                if (f.doesMatch(flat, evTags)) doSend = true;
+            }
+
+            return doSend && handleEvent(levId, created);
         };
 
         while (1) {
             approxWork++;
             if (doPause(approxWork)) return false;
 
-            if (nextInitIndex < cursors.size()) {
-                approxWork += cursors[nextInitIndex].collect(txn, *this, nextInitIndex, initialScanDepth, eventQueue);
-                nextInitIndex++;
+            if (!primary.initialised()) {
+                approxWork += primary.initStep(txn, f);
+                continue;
+            }
 
-                if (nextInitIndex == cursors.size()) {
-                    std::sort(eventQueue.begin(), eventQueue.end(), cmp);
-                }
+            if (secondary && !secondary->initialised()) {
+                approxWork += secondary->initStep(txn, f);
+                continue;
+            }
+
+            if (!secondary) {
+                if (primary.empty()) return true;
+
+                auto ev = primary.front();
+                approxWork += primary.pop(txn, f);
+
+                if (handleCandidate(ev.levId(), ev.created())) return true;
 
                 continue;
-            } else if (eventQueue.size() == 0) {
-                return true;
             }
 
-            auto ev = eventQueue.front();
-            eventQueue.pop_front();
-            bool doSend = false;
-            uint64_t levId = ev.levId();
+            // Leapfrog intersection: whichever side is ahead seeks back to the other side's timestamp
 
-            if (indexOnly) {
-                if (f.doesMatchTimes(ev.created())) doSend = true;
-            } else {
-                approxWork += 10;
-                if (f.doesMatch(lookupEventByLevId(txn, levId).flat_nested())) doSend = true;
+            if (primary.empty() || secondary->empty()) return true;
+
+            uint64_t createdPrimary = primary.front().created();
+            uint64_t createdSecondary = secondary->front().created();
+
+            if (createdPrimary > createdSecondary) {
+                approxWork += primary.skipTo(txn, f, createdSecondary);
+                continue;
+            } else if (createdSecondary > createdPrimary) {
+                approxWork += secondary->skipTo(txn, f, createdPrimary);
+                continue;
+            }
+
+            // Both sides are at the same timestamp. levId order within a timestamp isn't guaranteed
+            // across cursors, so gather everything with this timestamp from each side and intersect.
+
+            uint64_t created = createdPrimary;
+
+            auto gather = [&](IndexScan &s, std::vector<uint64_t> &out){
+                out.clear();
+
+                while (!s.empty() && s.front().created() == created) {
+                    out.push_back(s.front().levId());
+                    approxWork += s.pop(txn, f);
+                }
+
+                std::sort(out.begin(), out.end(), std::greater<uint64_t>());
+                out.erase(std::unique(out.begin(), out.end()), out.end());
+            };
+
+            gather(primary, intersectPrimary);
+            gather(*secondary, intersectSecondary);
+
+            for (auto levId : intersectPrimary) {
+                if (!std::binary_search(intersectSecondary.begin(), intersectSecondary.end(), levId, std::greater<uint64_t>())) continue;
+                if (handleCandidate(levId, created)) return true;
             }
+        }
+    }
+
+  private:
+    DBScan(const DBScan &parent, uint64_t part, uint64_t numParts) : f(parent.f), indexOnly(parent.indexOnly), desc(parent.desc) {
+        primary.indexDbi = parent.primary.indexDbi;
+        primary.desc = parent.primary.desc;
+
+        std::string_view prefixes = parent.primary.prefixes;
+
+        // Round-robin, so that neighbouring keys (which may have similar sizes) are spread out
+        for (uint64_t i = part; i < parent.primary.cursors.size(); i += numParts) {
+            const auto &c = parent.primary.cursors[i];
+            primary.addCursor(c.resumeKey, c.resumeVal, c.keyMatch, prefixes.substr(c.prefixOffset, c.prefixSize));
+        }
+
+        primary.setDepths(f.limit);
+    }
+
+    bool isCovered(const Coverage &covered) {
+        return (!f.authors || covered.authors) &&
+               (!f.kinds || covered.kinds) &&
+               f.tags.size() == covered.tags.size();
+    }
+
+    // The leapfrog intersection in scan() needs each side's created values to only ever decrease. A
+    // cursor that stays within one index key guarantees this, but cursors for prefix pubkeys walk
+    // several keys and are only sorted within each batch, so a later batch could bring up events
+    // that the other side has already skipped past.
+
+    bool isExactKeyPath(const AccessPath &path) {
+        if (path.type != AccessPath::Type::Pubkey && path.type != AccessPath::Type::PubkeyKind) return true;
+        return allFullAuthors();
+    }
+
+    bool allFullAuthors() {
+        for (const auto &item : f.authors->items) {
+            if (item.size != 32) return false;
+        }
+
+        return true;
+    }
+
+    // Sum of the estimated records for each key, extrapolated from a sample when there are many keys
+
+    template<typename KeyFn>
+    uint64_t estimateRecords(lmdb::txn &txn, IndexStatsType type, uint64_t numKeys, KeyFn keyFn) {
+        uint64_t step = std::max(uint64_t(1), numKeys / MAX_ESTIMATE_SAMPLES);
+        uint64_t total = 0, sampled = 0;
+
+        for (uint64_t i = 0; i < numKeys; i += step) {
+            auto key = keyFn(i);
+            total += key ? IndexStats::estimate(txn, type, *key) : UNKNOWN_KEY_ESTIMATE;
+            sampled++;
+        }
+
+        return total * numKeys / sampled + numKeys; // + one seek per cursor
+    }
+
+    // Without IndexStats the paths are ranked in a fixed order: tagKind, tags (fewest items first), then pubkeyKind, pubkey, kind.
+    // If exactKeysOnly, paths that can't be intersected (see isExactKeyPath) are skipped.
+
+    AccessPath cheapestPath(lmdb::txn &txn, bool haveStats, const Coverage &covered, bool exactKeysOnly = false) {
+        AccessPath best;
+
+        auto consider = [&](AccessPath::Type type, char tagName, uint64_t rank, uint64_t numKeys, auto estimate){
+            uint64_t cost = haveStats ? estimate() : (rank << 40 | numKeys);
+            if (cost < best.cost) best = AccessPath{ type, tagName, cost };
+        };
+
+        for (const auto &[tagName, filterSet] : f.tags) {
+            if (covered.tags.contains(tagName)) continue;
+
+            auto tagEstimate = [&]{
+                return estimateRecords(txn, IndexStatsType::Tag, filterSet.size(), [&](uint64_t i){
+                    return std::optional<std::string>(std::string(1, tagName) + filterSet.at(i));
+                });
+            };
+
+            if (f.kinds && !covered.kinds && filterSet.size() * f.kinds->size() < 1'000) {
+                // Records for each (tag, kind) key are a subset of both the tag's and the kind's records
+                consider(AccessPath::Type::TagKind, tagName, 0, filterSet.size() * f.kinds->size(), [&]{
+                    return std::min(tagEstimate(), estimateRecords(txn, IndexStatsType::Kind, f.kinds->size(), [&](uint64_t i){
+                        return std::optional<std::string>(std::string(lmdb::to_sv<uint64_t>(f.kinds->at(i))));
+                    }));
+                });
+            }
+
+            consider(AccessPath::Type::Tag, tagName, 1, filterSet.size(), tagEstimate);
+        }
+
+        bool canUseAuthors = f.authors && !covered.authors && (!exactKeysOnly || allFullAuthors());
+
+        if (canUseAuthors && f.kinds && !covered.kinds && f.authors->size() * f.kinds->size() < 1'000) {
+            uint64_t numKinds = f.kinds->size();
+
+            consider(AccessPath::Type::PubkeyKind, '\0', 2, f.authors->size() * numKinds, [&]{
+                return estimateRecords(txn, IndexStatsType::PubkeyKind, f.authors->size() * numKinds, [&](uint64_t i){
+                    std::string pubkey = f.authors->at(i / numKinds);
+                    if (pubkey.size() != 32) return std::optional<std::string>();
+                    return std::optional<std::string>(pubkey + std::string(lmdb::to_sv<uint64_t>(f.kinds->at(i % numKinds))));
+                });
+            });
+        }
+
+        if (canUseAuthors) {
+            consider(AccessPath::Type::Pubkey, '\0', 3, f.authors->size(), [&]{
+                return estimateRecords(txn, IndexStatsType::Pubkey, f.authors->size(), [&](uint64_t i){
+                    std::string pubkey = f.authors->at(i);
+                    if (pubkey.size() != 32) return std::optional<std::string>();
+                    return std::optional<std::string>(pubkey);
+                });
+            });
+        }
+
+        if (f.kinds && !covered.kinds) {
+            consider(AccessPath::Type::Kind, '\0', 4, f.kinds->size(), [&]{
+                return estimateRecords(txn, IndexStatsType::Kind, f.kinds->size(), [&](uint64_t i){
+                    return std::optional<std::string>(std::string(lmdb::to_sv<uint64_t>(f.kinds->at(i))));
+                });
+            });
+        }
+
+        return best;
+    }
+
+    void setupPath(IndexScan &s, const AccessPath &path, Coverage &covered) {
+        switch (path.type) {
+            case AccessPath::Type::TagKind:
+                setupTagKindScan(s, path.tagName);
+                covered.tags.insert(path.tagName);
+                covered.kinds = true;
+                break;
+            case AccessPath::Type::Tag:
+                setupTagScan(s, path.tagName);
+                covered.tags.insert(path.tagName);
+                break;
+            case AccessPath::Type::PubkeyKind:
+                setupPubkeyKindScan(s);
+                covered.authors = covered.kinds = true;
+                break;
+            case AccessPath::Type::Pubkey:
+                setupPubkeyScan(s);
+                covered.authors = true;
+                break;
+            case AccessPath::Type::Kind:
+                setupKindScan(s);
+                covered.kinds = true;
+                break;
+            case AccessPath::Type::CreatedAt:
+                setupCreatedAtScan(s);
+                break;
+        }
+    }
 
-            if (doSend) {
-                if (handleEvent(levId)) return true;
+    void setupIdScan(IndexScan &s) {
+        s.indexDbi = env.dbi_Event__id;
+        s.desc = "ID";
+
+        s.cursors.reserve(f.ids->size());
+        for (uint64_t i = 0; i < f.ids->size(); i++) {
+            std::string prefix = f.ids->at(i);
+            s.addCursor(padBytes(prefix, 32 + 8, '\xFF'), MAX_U64, PrefixMatcher{}, prefix);
+        }
+    }
+
+    void setupTagScan(IndexScan &s, char tagName) {
+        s.indexDbi = env.dbi_Event__tag;
+        s.desc = "Tag";
+
+        const auto &filterSet = f.tags.at(tagName);
+
+        s.cursors.reserve(filterSet.size());
+        for (uint64_t i = 0; i < filterSet.size(); i++) {
+            std::string search;
+            search += tagName;
+            search += filterSet.at(i);
+
+            s.addCursor(search + std::string(8, '\xFF'), MAX_U64, ExactMatcher{}, search);
+        }
+    }
+
+    void setupTagKindScan(IndexScan &s, char tagName) {
+        s.indexDbi = env.dbi_Event__tagKind;
+        s.desc = "TagKind";
+
+        const auto &filterSet = f.tags.at(tagName);
+
+        s.cursors.reserve(filterSet.size() * f.kinds->size());
+        for (uint64_t i = 0; i < filterSet.size(); i++) {
+            for (uint64_t j = 0; j < f.kinds->size(); j++) {
+                std::string search;
+                search += tagName;
+                search += filterSet.at(i);
+                search += lmdb::to_sv<uint64_t>(f.kinds->at(j));
+
+                s.addCursor(search + std::string(8, '\xFF'), MAX_U64, ExactMatcher{}, search);
             }
+        }
+    }
+
+    void setupPubkeyKindScan(IndexScan &s) {
+        s.indexDbi = env.dbi_Event__pubkeyKind;
+        s.desc = "PubkeyKind";
 
-            cursors[ev.scanIndex()].outstanding--;
+        s.cursors.reserve(f.authors->size() * f.kinds->size());
+        for (uint64_t i = 0; i < f.authors->size(); i++) {
+            for (uint64_t j = 0; j < f.kinds->size(); j++) {
+                uint64_t kind = f.kinds->at(j);
 
-            if (cursors[ev.scanIndex()].outstanding == 0) {
-                std::deque<CandidateEvent> moreEvents;
-                std::deque<CandidateEvent> newEventQueue;
-                approxWork += cursors[ev.scanIndex()].collect(txn, *this, ev.scanIndex(), refillScanDepth, moreEvents);
+                std::string prefix = f.authors->at(i);
+                if (prefix.size() == 32) prefix += lmdb::to_sv<uint64_t>(kind);
 
-                std::merge(eventQueue.begin(), eventQueue.end(), moreEvents.begin(), moreEvents.end(), std::back_inserter(newEventQueue), cmp);
-                eventQueue.swap(newEventQueue);
+                s.addCursor(padBytes(prefix, 32 + 8 + 8, '\xFF'), MAX_U64, PubkeyKindMatcher{ kind }, prefix);
             }
         }
     }
+
+    void setupPubkeyScan(IndexScan &s) {
+        s.indexDbi = env.dbi_Event__pubkey;
+        s.desc = "Pubkey";
+
+        s.cursors.reserve(f.authors->size());
+        for (uint64_t i = 0; i < f.authors->size(); i++) {
+            std::string prefix = f.authors->at(i);
+            s.addCursor(padBytes(prefix, 32 + 8, '\xFF'), MAX_U64, PrefixMatcher{}, prefix);
+        }
+    }
+
+    void setupKindScan(IndexScan &s) {
+        s.indexDbi = env.dbi_Event__kind;
+        s.desc = "Kind";
+
+        s.cursors.reserve(f.kinds->size());
+        for (uint64_t i = 0; i < f.kinds->size(); i++) {
+            uint64_t kind = f.kinds->at(i);
+            s.addCursor(std::string(lmdb::to_sv<uint64_t>(kind)) + std::string(8, '\xFF'), MAX_U64, KindMatcher{ kind });
+        }
+    }
+
+    void setupCreatedAtScan(IndexScan &s) {
+        s.indexDbi = env.dbi_Event__created_at;
+        s.desc = "CreatedAt";
+
+        s.cursors.reserve(1);
+        s.addCursor(std::string(8, '\xFF'), MAX_U64, AllMatcher{});
+    }
 };
 
 
@@ -295,8 +739,29 @@ struct DBQuery : NonCopyable {
     bool dead = false; // external flag
     flat_hash_set<uint64_t> sentEventsFull;
     flat_hash_set<uint64_t> sentEventsCurr;
+
+    // Used by QueryScheduler when sharing or caching scans
+    std::string filterKey; // canonical filter group
+    bool isLeader = false;
+    bool recordSent = false; // if true, sentEventsOrdered is maintained
+    std::vector<uint64_t> sentEventsOrdered;
+    std::vector<DBQuery*> followers;
+    bool recordResults = false; // if true, filterResults is maintained
+    std::vector<std::vector<DBScan::CandidateEvent>> filterResults; // for each filter, every event it matched, in scan order
     uint64_t lastWorkChecked = 0;
 
+    // Filters with a limit and enough cursors can have their scans split between this many threads
+    uint64_t maxParallelism = 1;
+
+    struct Partition {
+        std::unique_ptr<DBScan> scanner;
+        std::vector<DBScan::CandidateEvent> results;
+        flat_hash_set<uint64_t> found;
+        bool complete = false;
+    };
+
+    std::vector<Partition> partitions; // if the current filter's scan has been split, see scanPartitioned()
+
     uint64_t currScanTime = 0;
     uint64_t currScanSaveRestores = 0;
     uint64_t totalTime = 0;
@@ -306,34 +771,57 @@ struct DBQuery : NonCopyable {
     DBQuery(const tao::json::value &filter, uint64_t maxLimit = MAX_U64) : sub(Subscription(1, ".", NostrFilterGroup::unwrapped(filter, maxLimit))) {}
 
     // If scan is complete, returns true
-    bool process(lmdb::txn &txn, std::function<void(const Subscription &, uint64_t)> cb, uint64_t timeBudgetMicroseconds = MAX_U64, bool logMetrics = false) {
+    template<typename CB>
+    bool process(lmdb::txn &txn, CB cb, uint64_t timeBudgetMicroseconds = MAX_U64, bool logMetrics = false) {
         while (filterGroupIndex < sub.filterGroup.size()) {
             const auto &f = sub.filterGroup.filters[filterGroupIndex];
 
-            if (!scanner) scanner = std::make_unique<DBScan>(f);
+            if (!scanner) scanner = std::make_unique<DBScan>(txn, f);
 
             uint64_t startTime = hoytech::curr_time_us();
 
-            bool complete = scanner->scan(txn, [&](uint64_t levId){
+            if (recordResults && filterResults.size() <= filterGroupIndex) filterResults.resize(filterGroupIndex + 1);
+
+            auto handleEvent = [&](uint64_t levId, uint64_t created){
                 if (f.limit == 0) return true;
 
                 // If this event came in after our query began, don't send it. It will be sent after the EOSE.
                 if (levId > sub.latestEventId) return false;
 
+                if (recordResults) filterResults[filterGroupIndex].emplace_back(levId, created); // also if sent by an earlier filter, see QueryCache::insert
+
                 if (sentEventsFull.find(levId) == sentEventsFull.end()) {
                     sentEventsFull.insert(levId);
+                    if (recordSent) sentEventsOrdered.push_back(levId);
                     cb(sub, levId);
                 }
 
                 sentEventsCurr.insert(levId);
                 return sentEventsCurr.size() >= f.limit;
-            }, [&](uint64_t approxWork){
-                if (approxWork > lastWorkChecked + 2'000) {
-                    lastWorkChecked = approxWork;
-                    return hoytech::curr_time_us() - startTime > timeBudgetMicroseconds;
+            };
+
+            bool complete;
+            if (partitions.empty() && f.limit != MAX_U64 && f.limit > 0) {
+                uint64_t numPartitions = scanner->numPartitions(maxParallelism);
+
+                if (numPartitions > 1) {
+                    for (auto &part : scanner->partition(numPartitions)) partitions.emplace_back(Partition{ std::move(part) });
                 }
-                return false;
-            });
+            }
+
+            uint64_t numPartitions = std::max(partitions.size(), size_t(1));
+
+            if (partitions.size()) {
+                complete = scanPartitioned(txn, f, handleEvent, startTime, timeBudgetMicroseconds);
+            } else {
+                complete = scanner->scan(txn, handleEvent, [&](uint64_t approxWork){
+                    if (approxWork > lastWorkChecked + 2'000) {
+                        lastWorkChecked = approxWork;
+                        return hoytech::curr_time_us() - startTime > timeBudgetMicroseconds;
+                    }
+                    return false;
+                });
+            }
 
             currScanTime += hoytech::curr_time_us() - startTime;
 
@@ -348,7 +836,9 @@ struct DBQuery : NonCopyable {
             if (logMetrics) {
                 LI << "[" << sub.connId << "] REQ='" << sub.subId.sv() << "'"
                    << " scan=" << scanner->desc
+                   << " partitions=" << numPartitions
                    << " indexOnly=" << scanner->indexOnly
+                   << " est=" << scanner->estimatedRecords
                    << " time=" << currScanTime << "us"
                    << " saveRestores=" << currScanSaveRestores
                    << " recsFound=" << sentEventsCurr.size()
@@ -372,6 +862,64 @@ struct DBQuery : NonCopyable {
             ;
         }
 
+        return true;
+    }
+
+  private:
+    // Each partition finds its own first f.limit events. Since the partitions' cursors are disjoint,
+    // the newest f.limit of all of these are the newest f.limit events of the whole scan, so nothing
+    // is sent until every partition has completed. Partitions pause at the end of the timeslice like
+    // any other scan, and are resumed by the next call. Returns true once all are complete.
+
+    template<typename H>
+    bool scanPartitioned(lmdb::txn &txn, const NostrFilter &f, H handleEvent, uint64_t startTime, uint64_t timeBudgetMicroseconds) {
+        uint64_t latestEventId = sub.latestEventId;
+
+        std::vector<ScanHelpers::Job> jobs;
+
+        for (auto &part : partitions) {
+            if (part.complete) continue;
+
+            jobs.emplace_back([&](lmdb::txn &partTxn){
+                uint64_t lastChecked = 0;
+
+                part.complete = part.scanner->scan(partTxn, [&](uint64_t levId, uint64_t created){
+                    if (levId > latestEventId) return false; // If this event came in after our query began, it will be sent after the EOSE
+                    if (!part.found.insert(levId).second) return false;
+                    part.results.emplace_back(levId, created);
+                    return part.results.size() >= f.limit;
+                }, [&](uint64_t approxWork){
+                    if (approxWork > lastChecked + 2'000) {
+                        lastChecked = approxWork;
+                        return hoytech::curr_time_us() - startTime > timeBudgetMicroseconds;
+                    }
+                    return false;
+                });
+            });
+        }
+
+        uint64_t numJobs = jobs.size();
+        ScanHelpers::run(txn, std::move(jobs), numJobs - 1);
+
+        for (const auto &part : partitions) {
+            if (!part.complete) return false;
+        }
+
+        std::vector<DBScan::CandidateEvent> merged;
+
+        for (auto &part : partitions) {
+            merged.insert(merged.end(), part.results.begin(), part.results.end());
+            scanner->approxWork += part.scanner->approxWork;
+        }
+
+        partitions.clear();
+
+        std::sort(merged.begin(), merged.end(), DBScan::candidateCmp);
+
+        for (const auto &ev : merged) {
+            if (handleEvent(ev.levId(), ev.created())) break;
+        }
+
         return true;
     }
 };
@@ -0,0 +1,5 @@
+#include "golpe.h"
+
+#include "HotEventCache.h"
+
+HotEventCache globalHotEventCache;
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#include "golpe.h"
+
+#include "Decompressor.h"
+#include "events.h"
+
+
+// Decoded JSON of recently sent events, shared by all threads. Popular events (profiles, recent
+// notes) are requested by many subscriptions, and without this would be decompressed again for each.
+// Entries are immutable and reference counted, so they can be handed to the websocket thread
+// without copying and remain valid after being evicted.
+//
+// Keyed by levId, which is never re-used, so entries never need to be invalidated. Callers must
+// check that the event still exists before using the cache.
+
+using EventJson = std::shared_ptr<const std::string>;
+
+struct HotEventCache {
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    std::atomic<uint64_t> evictions = 0;
+    std::atomic<uint64_t> bytes = 0;
+    std::atomic<uint64_t> entries = 0;
+
+    // eventPayload is the event's raw EventPayload record, and is only decoded on a miss
+
+    EventJson get(lmdb::txn &txn, Decompressor &decomp, uint64_t levId, std::string_view eventPayload) {
+        uint64_t maxBytes = cfg().relay__hotEventCache__maxBytes;
+        if (maxBytes == 0) return decode(txn, decomp, levId, eventPayload);
+
+        auto &shard = shards[levId % NUM_SHARDS];
+
+        {
+            std::lock_guard<std::mutex> guard(shard.mutex);
+
+            auto it = shard.index.find(levId);
+            if (it != shard.index.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                hits++;
+                return it->second->json;
+            }
+        }
+
+        misses++;
+
+        auto json = decode(txn, decomp, levId, eventPayload);
+
+        {
+            std::lock_guard<std::mutex> guard(shard.mutex);
+
+            if (shard.index.contains(levId)) return json; // inserted by another thread while we were decoding
+
+            shard.lru.push_front(Entry{ levId, json });
+            shard.index.emplace(levId, shard.lru.begin());
+            shard.bytes += json->size();
+            bytes += json->size();
+            entries++;
+
+            while (shard.bytes > maxBytes / NUM_SHARDS && shard.lru.size() > 1) {
+                auto &e = shard.lru.back();
+                shard.bytes -= e.json->size();
+                bytes -= e.json->size();
+                entries--;
+                evictions++;
+                shard.index.erase(e.levId);
+                shard.lru.pop_back();
+            }
+        }
+
+        return json;
+    }
+
+    EventJson get(lmdb::txn &txn, Decompressor &decomp, uint64_t levId) {
+        std::string_view eventPayload;
+
+        bool found = env.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(levId), eventPayload);
+        if (!found) throw herr("couldn't find event in EventPayload");
+
+        return get(txn, decomp, levId, eventPayload);
+    }
+
+  private:
+    static const size_t NUM_SHARDS = 16;
+
+    struct Entry {
+        uint64_t levId;
+        EventJson json;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru; // most recently used first
+        flat_hash_map<uint64_t, std::list<Entry>::iterator> index;
+        uint64_t bytes = 0;
+    };
+
+    Shard shards[NUM_SHARDS];
+
+    static EventJson decode(lmdb::txn &txn, Decompressor &decomp, uint64_t levId, std::string_view eventPayload) {
+        return std::make_shared<const std::string>(getEventJson(txn, decomp, levId, eventPayload));
+    }
+};
+
+extern HotEventCache globalHotEventCache;
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "golpe.h"
+
+#include "events.h"
+
+
+// Approximate number of records per key in the tag, pubkey, kind, and pubkeyKind indices.
+// Stored in the IndexStats table as a count-min sketch: every key increments one bucket in
+// each of NUM_ROWS rows, and the estimate is the smallest of those buckets. Collisions can
+// only inflate a bucket, so estimates are never lower than the real count.
+//
+// Over-estimates are around (records in that index) / (buckets per row), so rare keys are only
+// told apart from popular ones while there are enough buckets. The number of buckets is chosen
+// from the size of the DB when the sketch is built, and a warning is logged at startup once the
+// DB has grown to REBUILD_GROWTH times that size. Past MAX_BUCKET_BITS (16M buckets per row),
+// estimates for rare keys degrade again as the DB grows.
+
+enum class IndexStatsType : uint64_t {
+    Tag = 1,
+    Pubkey = 2,
+    Kind = 3,
+    PubkeyKind = 4,
+};
+
+struct IndexStats {
+    static constexpr uint64_t NUM_ROWS = 3;
+    static constexpr uint64_t MIN_BUCKET_BITS = 16;
+    static constexpr uint64_t MAX_BUCKET_BITS = 24;
+    static constexpr uint64_t REBUILD_GROWTH = 4;
+    static constexpr uint64_t READY_KEY = 0; // present once the sketch reflects the whole DB, value is its bucket bits
+
+    // Persisted, so must be stable across builds (std::hash isn't)
+
+    static uint64_t hashKey(std::string_view key, uint64_t seed) {
+        uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+
+        for (unsigned char c : key) {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+
+        return h;
+    }
+
+    static uint64_t bucketId(IndexStatsType type, uint64_t row, std::string_view key, uint64_t bucketBits) {
+        return (uint64_t)type << 56 | row << 48 | (hashKey(key, row) & ((1ULL << bucketBits) - 1));
+    }
+
+    // 0 if the sketch hasn't been built
+
+    static uint64_t bucketBits(lmdb::txn &txn) {
+        std::string_view v;
+        if (!env.dbi_IndexStats.get(txn, lmdb::to_sv<uint64_t>(READY_KEY), v)) return 0;
+        return lmdb::from_sv<uint64_t>(v);
+    }
+
+    static bool ready(lmdb::txn &txn) {
+        return bucketBits(txn) != 0;
+    }
+
+    // Smallest number of bucket bits that gives at least one bucket per event
+
+    static uint64_t bucketBitsFor(uint64_t numEvents) {
+        uint64_t bits = MIN_BUCKET_BITS;
+        while (bits < MAX_BUCKET_BITS && (1ULL << bits) < numEvents) bits++;
+        return bits;
+    }
+
+    static uint64_t estimate(lmdb::txn &txn, IndexStatsType type, std::string_view key) {
+        uint64_t bits = bucketBits(txn);
+        uint64_t output = MAX_U64;
+
+        for (uint64_t row = 0; row < NUM_ROWS; row++) {
+            std::string_view v;
+            uint64_t count = 0;
+            if (env.dbi_IndexStats.get(txn, lmdb::to_sv<uint64_t>(bucketId(type, row, key, bits)), v)) count = lmdb::from_sv<uint64_t>(v);
+            output = std::min(output, count);
+        }
+
+        return output;
+    }
+
+    // Accumulates count changes so that a batch of writes only touches each bucket once
+
+    struct Delta {
+        uint64_t bucketBits;
+        flat_hash_map<uint64_t, int64_t> changes;
+
+        Delta(uint64_t bucketBits) : bucketBits(bucketBits) {}
+        Delta(lmdb::txn &txn) : bucketBits(IndexStats::bucketBits(txn)) {}
+
+        void add(IndexStatsType type, std::string_view key, int64_t n) {
+            if (!bucketBits) return; // counted when the sketch is built
+            for (uint64_t row = 0; row < NUM_ROWS; row++) changes[bucketId(type, row, key, bucketBits)] += n;
+        }
+
+        void addEvent(const NostrIndex::Event *flat, int64_t n) {
+            std::string buf;
+
+            uint64_t kind = flat->kind();
+            auto kindSv = lmdb::to_sv<uint64_t>(kind);
+
+            add(IndexStatsType::Pubkey, sv(flat->pubkey()), n);
+            add(IndexStatsType::Kind, kindSv, n);
+
+            buf = sv(flat->pubkey());
+            buf += kindSv;
+            add(IndexStatsType::PubkeyKind, buf, n);
+
+            for (const auto &tagPair : *(flat->tagsGeneral())) {
+                buf.clear();
+                buf += (char)tagPair->key();
+                buf += sv(tagPair->val());
+                add(IndexStatsType::Tag, buf, n);
+            }
+
+            for (const auto &tagPair : *(flat->tagsFixed32())) {
+                buf.clear();
+                buf += (char)tagPair->key();
+                buf += sv(tagPair->val());
+                add(IndexStatsType::Tag, buf, n);
+            }
+        }
+
+        void apply(lmdb::txn &txn) {
+            for (const auto &[id, n] : changes) {
+                if (n == 0) continue;
+
+                std::string_view key = lmdb::to_sv<uint64_t>(id);
+                std::string_view v;
+                int64_t count = 0;
+                if (env.dbi_IndexStats.get(txn, key, v)) count = (int64_t)lmdb::from_sv<uint64_t>(v);
+
+                count += n;
+
+                if (count <= 0) env.dbi_IndexStats.del(txn, key);
+                else env.dbi_IndexStats.put(txn, key, lmdb::to_sv<uint64_t>((uint64_t)count));
+            }
+
+            changes.clear();
+        }
+    };
+
+    // True if the DB has grown enough since the sketch was built that it should be rebuilt with more buckets
+
+    static bool outgrown(lmdb::txn &txn) {
+        uint64_t bits = bucketBits(txn);
+        return bits < MAX_BUCKET_BITS && bucketBitsFor(getMostRecentLevId(txn) / REBUILD_GROWTH) > bits;
+    }
+
+    // Empties the sketch and marks it ready with the given number of bucket bits. Only correct for an empty DB, or before counting every event.
+
+    static void reset(lmdb::txn &txn, uint64_t newBits) {
+        auto cursor = lmdb::cursor::open(txn, env.dbi_IndexStats);
+        std::string_view k, v;
+        while (cursor.get(k, v, MDB_FIRST)) cursor.del();
+
+        env.dbi_IndexStats.put(txn, lmdb::to_sv<uint64_t>(READY_KEY), lmdb::to_sv<uint64_t>(newBits));
+    }
+
+    // Called on startup. Rebuilding needs a pass over every event, so it is never done implicitly: an
+    // empty DB gets an empty sketch, and otherwise the operator is told to run "strfry stats --rebuild".
+    // Until then, DBScan ranks indices without statistics (if not ready) or with less accurate ones.
+
+    static void check(lmdb::txn &txn) {
+        if (!ready(txn)) {
+            if (getMostRecentLevId(txn) == 0) reset(txn, MIN_BUCKET_BITS);
+            else LW << "Index statistics haven't been built, so query planning is less accurate. Run 'strfry stats --rebuild' to build them";
+        } else if (outgrown(txn)) {
+            LW << "Index statistics are too small for the size of the DB, so query planning is less accurate. Run 'strfry stats --rebuild' to resize them";
+        }
+    }
+
+    // Builds the sketch from scratch, sized for the current DB
+
+    static void rebuild(lmdb::txn &txn) {
+        uint64_t maxEvents = getMostRecentLevId(txn); // upper bound, since deleted levIds aren't reused
+        uint64_t newBits = bucketBitsFor(maxEvents);
+
+        reset(txn, newBits);
+
+        Delta delta(newBits);
+        uint64_t numEvents = 0;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            delta.addEvent(ev.flat_nested(), 1);
+            numEvents++;
+
+            if (delta.changes.size() > 1'000'000) delta.apply(txn);
+
+            return true;
+        });
+
+        delta.apply(txn);
+
+        LI << "Index statistics built for " << numEvents << " events, with " << (1ULL << newBits) << " buckets per row";
+    }
+};
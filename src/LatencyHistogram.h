@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <cmath>
+
+#include "golpe.h"
+
+
+// Log2-bucketed histogram of durations in microseconds. Can be recorded to from any thread.
+
+struct LatencyHistogram {
+    static const size_t NUM_BUCKETS = 32; // bucket i holds durations in [2^(i-1), 2^i), bucket 0 holds 0
+
+    std::atomic<uint64_t> buckets[NUM_BUCKETS] = {};
+
+    void record(uint64_t us) {
+        size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        if (bucket >= NUM_BUCKETS) bucket = NUM_BUCKETS - 1;
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Summarises and resets the histogram. Percentiles are reported as their bucket's upper bound.
+
+    std::string render() {
+        uint64_t counts[NUM_BUCKETS];
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            counts[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+            total += counts[i];
+        }
+
+        auto percentile = [&](double p) -> uint64_t {
+            uint64_t target = std::max(uint64_t(1), (uint64_t)std::ceil(p * total)), seen = 0;
+
+            for (size_t i = 0; i < NUM_BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= target) return 1ULL << i;
+            }
+
+            return 1ULL << (NUM_BUCKETS - 1);
+        };
+
+        std::string output = "n=" + std::to_string(total);
+        if (total == 0) return output;
+
+        output += " p50<" + std::to_string(percentile(0.5)) + "us";
+        output += " p90<" + std::to_string(percentile(0.9)) + "us";
+        output += " p99<" + std::to_string(percentile(0.99)) + "us";
+        output += " max<" + std::to_string(percentile(1.0)) + "us";
+
+        return output;
+    }
+};
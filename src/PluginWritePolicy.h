@@ -53,6 +53,17 @@ struct PluginWritePolicy {
 
     std::unique_ptr<RunningPlugin> running; 
 
+    // Only parses jsonStr if there is a plugin to send it to
+
+    WritePolicyResult acceptEventJson(std::string_view jsonStr, uint64_t receivedAt, EventSourceType sourceType, std::string_view sourceInfo, std::string &okMsg) {
+        if (cfg().relay__writePolicy__plugin.size() == 0) {
+            running.reset();
+            return WritePolicyResult::Accept;
+        }
+
+        return acceptEvent(tao::json::from_string(jsonStr), receivedAt, sourceType, sourceInfo, okMsg);
+    }
+
     WritePolicyResult acceptEvent(const tao::json::value &evJson, uint64_t receivedAt, EventSourceType sourceType, std::string_view sourceInfo, std::string &okMsg) {
         const auto &pluginPath = cfg().relay__writePolicy__plugin;
 
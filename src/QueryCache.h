@@ -0,0 +1,169 @@
+#pragma once
+
+#include <list>
+#include <atomic>
+
+#include "golpe.h"
+
+#include "filters.h"
+#include "DBQuery.h"
+
+
+// LRU cache of completed REQ results, keyed by the canonical filter group. Each entry holds the
+// events that matched each filter as of latestEventId. When an entry is used after newer events
+// have been written, those events are matched against the filters and merged into the results,
+// instead of scanning again.
+
+struct QueryCache : NonCopyable {
+    using FilterResults = std::vector<std::vector<DBScan::CandidateEvent>>;
+
+    struct Entry {
+        std::string key;
+        uint64_t latestEventId;
+        FilterResults filterResults;
+    };
+
+    uint64_t maxEntries = 0; // 0 disables the cache
+    uint64_t maxExtendEvents = 0; // entries further behind than this are rescanned
+
+    // Counters can be shared by several caches (ie one per ReqWorker thread), so that they can be logged together
+
+    struct Stats {
+        std::atomic<uint64_t> entries = 0;
+        std::atomic<uint64_t> hits = 0;
+        std::atomic<uint64_t> misses = 0;
+        std::atomic<uint64_t> extended = 0; // hits that needed newer events merged in
+        std::atomic<uint64_t> invalidated = 0; // entries dropped because they could no longer be brought up to date
+    };
+
+    Stats ownStats;
+    Stats *stats = &ownStats;
+
+    std::list<Entry> lru; // most recently used first
+    flat_hash_map<std::string, std::list<Entry>::iterator> entries;
+    EventTagIndex evTags;
+
+    // On a hit, appends the levIds to send to output (in the order a scan would send them)
+
+    bool lookup(lmdb::txn &txn, const NostrFilterGroup &fg, const std::string &key, uint64_t currEventId, std::vector<uint64_t> &output) {
+        if (maxEntries == 0) return false;
+
+        auto found = entries.find(key);
+
+        if (found == entries.end()) {
+            stats->misses++;
+            return false;
+        }
+
+        auto it = found->second;
+
+        if (it->latestEventId > currEventId) {
+            stats->misses++;
+            return false;
+        }
+
+        if (currEventId - it->latestEventId > maxExtendEvents || !refresh(txn, fg, *it, currEventId)) {
+            entries.erase(found);
+            lru.erase(it);
+            stats->entries--;
+            stats->invalidated++;
+            stats->misses++;
+            return false;
+        }
+
+        lru.splice(lru.begin(), lru, it);
+        stats->hits++;
+
+        flat_hash_set<uint64_t> sent;
+
+        for (const auto &results : it->filterResults) {
+            for (const auto &ev : results) {
+                if (sent.insert(ev.levId()).second) output.push_back(ev.levId());
+            }
+        }
+
+        return true;
+    }
+
+    // filterResults are each filter's matching events, in any order and possibly with duplicates
+
+    void insert(const std::string &key, uint64_t latestEventId, FilterResults &&filterResults) {
+        if (maxEntries == 0) return;
+
+        if (auto found = entries.find(key); found != entries.end()) {
+            lru.erase(found->second);
+            entries.erase(found);
+            stats->entries--;
+        }
+
+        // refresh() needs each filter's results in candidateCmp order to merge new events and evict the oldest
+        for (auto &results : filterResults) {
+            std::sort(results.begin(), results.end(), DBScan::candidateCmp);
+            results.erase(std::unique(results.begin(), results.end(), [](const auto &a, const auto &b){ return a.levId() == b.levId(); }), results.end());
+        }
+
+        lru.push_front(Entry{ key, latestEventId, std::move(filterResults) });
+        entries.emplace(key, lru.begin());
+        stats->entries++;
+
+        while (lru.size() > maxEntries) {
+            entries.erase(lru.back().key);
+            lru.pop_back();
+            stats->entries--;
+        }
+    }
+
+  private:
+    bool refresh(lmdb::txn &txn, const NostrFilterGroup &fg, Entry &e, uint64_t currEventId) {
+        if (e.filterResults.size() != fg.size()) return false;
+
+        // Deleted events can simply be dropped, unless the filter's limit was reached: then the
+        // next older matching event should take the deleted one's place, which needs a rescan.
+
+        for (size_t i = 0; i < fg.size(); i++) {
+            auto &results = e.filterResults[i];
+            bool full = results.size() >= fg.filters[i].limit;
+
+            size_t numErased = std::erase_if(results, [&](const auto &ev){
+                std::string_view v;
+                return !env.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(ev.levId()), v);
+            });
+
+            if (numErased && full) return false;
+        }
+
+        if (currEventId == e.latestEventId) return true;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            auto *flat = ev.flat_nested();
+            bool tagsBuilt = false;
+
+            for (size_t i = 0; i < fg.size(); i++) {
+                const auto &f = fg.filters[i];
+
+                if (!f.doesMatchFields(flat)) continue;
+
+                if (f.tags.size()) {
+                    if (!tagsBuilt) {
+                        evTags.build(flat);
+                        tagsBuilt = true;
+                    }
+
+                    if (!f.doesMatchTags(evTags)) continue;
+                }
+
+                auto &results = e.filterResults[i];
+                DBScan::CandidateEvent c(ev.primaryKeyId, flat->created_at());
+                results.insert(std::upper_bound(results.begin(), results.end(), c, DBScan::candidateCmp), c);
+                if (results.size() > f.limit) results.pop_back();
+            }
+
+            return true;
+        }, false, e.latestEventId + 1);
+
+        e.latestEventId = currEventId;
+        stats->extended++;
+
+        return true;
+    }
+};
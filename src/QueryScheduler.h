@@ -1,6 +1,7 @@
 #pragma once
 
 #include "DBQuery.h"
+#include "QueryCache.h"
 
 
 struct QueryScheduler : NonCopyable {
@@ -12,10 +13,25 @@ struct QueryScheduler : NonCopyable {
     // If false, then onEvent's eventPayload will always be ""
     bool ensureExists = true;
 
+    // If true, a sub whose filters are identical to those of a query that is still scanning
+    // doesn't start its own scan. Instead it follows that query (the "leader"): it is sent the
+    // events the leader has already found, and then everything the leader finds from then on.
+    bool shareScans = false;
+
+    // Passed to each DBQuery, see DBQuery::maxParallelism
+    uint64_t maxQueryParallelism = 1;
+
+    // Results of completed queries, used to answer identical REQs without scanning. Disabled unless cache.maxEntries is set.
+    QueryCache cache;
+
     using ConnQueries = flat_hash_map<SubId, DBQuery*>;
     flat_hash_map<uint64_t, ConnQueries> conns; // connId -> subId -> DBQuery*
     std::deque<DBQuery*> running;
+    flat_hash_map<uint64_t, std::vector<DBQuery*>> paused; // connId -> queries taken out of running until the conn is resumed
+    flat_hash_set<uint64_t> pausedConns;
+    flat_hash_map<std::string, DBQuery*> leaders; // canonical filter group -> leader
     std::vector<uint64_t> levIdBatch;
+    std::vector<std::string_view> eventPayloadBatch;
 
     bool addSub(lmdb::txn &txn, Subscription &&sub) {
         sub.latestEventId = getMostRecentLevId(txn);
@@ -25,16 +41,41 @@ struct QueryScheduler : NonCopyable {
             if (existing) removeSub(sub.connId, sub.subId);
         }
 
-        auto res = conns.try_emplace(sub.connId);
-        auto &connQueries = res.first->second;
-
-        if (connQueries.size() >= cfg().relay__maxSubsPerConnection) {
+        if (auto it = conns.find(sub.connId); it != conns.end() && it->second.size() >= cfg().relay__maxSubsPerConnection) {
             return false;
         }
 
+        std::string filterKey;
+        if (shareScans || cache.maxEntries) filterKey = sub.filterGroup.canonicalKey();
+
+        if (cache.lookup(txn, sub.filterGroup, filterKey, sub.latestEventId, levIdBatch)) {
+            deliver(txn, [&](auto send){
+                send(sub);
+            });
+
+            if (onComplete) onComplete(txn, sub);
+            return true;
+        }
+
         DBQuery *q = new DBQuery(sub);
 
-        connQueries.try_emplace(q->sub.subId, q);
+        conns[q->sub.connId].try_emplace(q->sub.subId, q);
+        q->filterKey = std::move(filterKey);
+
+        if (shareScans) {
+            if (auto it = leaders.find(q->filterKey); it != leaders.end()) {
+                follow(txn, it->second, q);
+                return true;
+            }
+
+            q->isLeader = true;
+            q->recordSent = true;
+            leaders.emplace(q->filterKey, q);
+        }
+
+        q->recordResults = cache.maxEntries > 0;
+        q->maxParallelism = maxQueryParallelism;
+
         running.push_front(q);
 
         return true;
@@ -56,15 +97,41 @@ struct QueryScheduler : NonCopyable {
         query->dead = true;
         conns[connId].erase(subId);
         if (conns[connId].empty()) conns.erase(connId);
+
+        // A paused query would otherwise wait for its conn to resume before being cleaned up
+        if (auto it = paused.find(connId); it != paused.end()) {
+            if (std::erase(it->second, query)) running.push_back(query);
+            if (it->second.empty()) paused.erase(it);
+        }
     }
 
     void closeConn(uint64_t connId) {
         auto f1 = conns.find(connId);
-        if (f1 == conns.end()) return;
 
-        for (auto &[k, v] : f1->second) v->dead = true;
+        if (f1 != conns.end()) {
+            for (auto &[k, v] : f1->second) v->dead = true;
+            conns.erase(f1);
+        }
+
+        resumeConn(connId); // so the dead queries get cleaned up
+    }
+
+    // While a connection is paused (because it isn't reading what has already been sent), its
+    // queries are not processed. Queries with followers still run, since the followers may be on
+    // other connections.
+
+    void pauseConn(uint64_t connId) {
+        pausedConns.insert(connId);
+    }
+
+    void resumeConn(uint64_t connId) {
+        pausedConns.erase(connId);
+
+        auto it = paused.find(connId);
+        if (it == paused.end()) return;
 
-        conns.erase(connId);
+        for (auto *q : it->second) running.push_back(q);
+        paused.erase(it);
     }
 
     void process(lmdb::txn &txn) {
@@ -73,39 +140,110 @@ struct QueryScheduler : NonCopyable {
         DBQuery *q = running.front();
         running.pop_front();
 
-        if (q->dead) {
+        // A dead leader keeps scanning as long as it has live followers
+
+        pruneFollowers(q);
+
+        if (q->dead && q->followers.empty()) {
+            if (q->isLeader) leaders.erase(q->filterKey);
             delete q;
             return;
         }
 
-        auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
-
-        bool complete = q->process(txn, [&](const auto &sub, uint64_t levId){
-            std::string_view eventPayload;
-
-            if (ensureExists) {
-                std::string_view key = lmdb::to_sv<uint64_t>(levId);
-                if (!eventPayloadCursor.get(key, eventPayload, MDB_SET_KEY)) return; // If not found, was deleted while scan was paused
-            }
+        if (pausedConns.contains(q->sub.connId) && !q->dead && q->followers.empty()) {
+            paused[q->sub.connId].push_back(q);
+            return;
+        }
 
-            if (onEvent) onEvent(txn, sub, levId, eventPayload);
-            if (onEventBatch) levIdBatch.push_back(levId);
+        bool complete = q->process(txn, [&](const auto &, uint64_t levId){
+            levIdBatch.push_back(levId);
         }, cfg().relay__queryTimesliceBudgetMicroseconds, cfg().relay__logging__dbScanPerf);
 
-        if (onEventBatch) {
-            onEventBatch(txn, q->sub, levIdBatch);
-            levIdBatch.clear();
-        }
+        deliver(txn, [&](auto send){
+            if (!q->dead) send(q->sub);
+            for (auto *f : q->followers) send(f->sub);
+        });
 
         if (complete) {
-            auto connId = q->sub.connId;
-            removeSub(connId, q->sub.subId);
+            if (q->isLeader) leaders.erase(q->filterKey);
+            if (q->recordResults) cache.insert(q->filterKey, q->sub.latestEventId, std::move(q->filterResults));
+
+            for (auto *f : q->followers) {
+                finish(txn, f);
+                delete f;
+            }
 
-            if (onComplete) onComplete(txn, q->sub);
+            if (!q->dead) finish(txn, q);
 
             delete q;
         } else {
             running.push_back(q);
         }
     }
+
+  private:
+    void finish(lmdb::txn &txn, DBQuery *q) {
+        removeSub(q->sub.connId, q->sub.subId);
+        if (onComplete) onComplete(txn, q->sub);
+    }
+
+    void follow(lmdb::txn &txn, DBQuery *leader, DBQuery *q) {
+        // Events that arrived after the leader's scan began are sent by the ReqMonitor after EOSE
+        q->sub.latestEventId = leader->sub.latestEventId;
+
+        leader->followers.push_back(q);
+
+        if (auto it = paused.find(leader->sub.connId); it != paused.end()) {
+            if (std::erase(it->second, leader)) running.push_back(leader);
+        }
+
+        levIdBatch = leader->sentEventsOrdered;
+
+        deliver(txn, [&](auto send){
+            send(q->sub);
+        });
+    }
+
+    void pruneFollowers(DBQuery *q) {
+        std::erase_if(q->followers, [](DBQuery *f){
+            if (!f->dead) return false;
+            delete f;
+            return true;
+        });
+    }
+
+    // Sends the events in levIdBatch to each sub passed to send() by forEachSub, then clears the batch
+
+    template<typename F>
+    void deliver(lmdb::txn &txn, F forEachSub) {
+        eventPayloadBatch.clear();
+
+        if (ensureExists) {
+            auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
+            size_t numFound = 0;
+
+            for (auto levId : levIdBatch) {
+                std::string_view key = lmdb::to_sv<uint64_t>(levId);
+                std::string_view eventPayload;
+                if (!eventPayloadCursor.get(key, eventPayload, MDB_SET_KEY)) continue; // If not found, was deleted while scan was paused
+
+                levIdBatch[numFound++] = levId;
+                eventPayloadBatch.push_back(eventPayload);
+            }
+
+            levIdBatch.resize(numFound);
+        } else {
+            eventPayloadBatch.resize(levIdBatch.size());
+        }
+
+        forEachSub([&](const Subscription &sub){
+            if (onEvent) {
+                for (size_t i = 0; i < levIdBatch.size(); i++) onEvent(txn, sub, levIdBatch[i], eventPayloadBatch[i]);
+            }
+
+            if (onEventBatch) onEventBatch(txn, sub, levIdBatch);
+        });
+
+        levIdBatch.clear();
+    }
 };
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "golpe.h"
+
+
+// Threads that help run the partitions of a large DB scan concurrently. Shared by all callers and
+// started on first use. The calling thread works on its own batch too, so a batch always makes
+// progress even if every helper is busy with other batches.
+//
+// Every job in a batch sees the caller's snapshot. A read txn can't be shared between threads, so
+// a helper opens its own, and only takes jobs if that txn has the same snapshot as the caller's
+// (ie no write has been committed since). Otherwise it leaves the jobs for the caller.
+
+struct ScanHelpers {
+    using Job = std::function<void(lmdb::txn &txn)>;
+
+    static void run(lmdb::txn &callerTxn, std::vector<Job> &&jobs, uint64_t numHelperThreads) {
+        auto batch = std::make_shared<Batch>();
+        batch->jobs = std::move(jobs);
+        batch->snapshotId = mdb_txn_id(callerTxn.handle());
+
+        auto &h = get();
+        h.ensureThreads(numHelperThreads);
+
+        {
+            std::lock_guard<std::mutex> guard(h.mutex);
+            for (size_t i = 1; i < batch->jobs.size(); i++) h.queue.push_back(batch);
+        }
+
+        h.cv.notify_all();
+
+        while (batch->runOne(callerTxn)) {}
+
+        {
+            std::unique_lock<std::mutex> lock(batch->mutex);
+            batch->cv.wait(lock, [&]{ return batch->done == batch->jobs.size(); });
+        }
+
+        if (batch->error) std::rethrow_exception(batch->error);
+    }
+
+  private:
+    struct Batch {
+        std::vector<Job> jobs;
+        uint64_t snapshotId;
+        std::atomic<size_t> next = 0;
+        std::atomic<size_t> done = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        // Claims and runs the next unstarted job, if any
+        bool runOne(lmdb::txn &txn) {
+            size_t i = next++;
+            if (i >= jobs.size()) return false;
+
+            try {
+                jobs[i](txn);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(mutex);
+                if (!error) error = std::current_exception();
+            }
+
+            if (++done == jobs.size()) {
+                std::lock_guard<std::mutex> guard(mutex);
+                cv.notify_all();
+            }
+
+            return true;
+        }
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<Batch>> queue; // one entry per job that may need a helper
+    uint64_t numThreads = 0;
+
+    static ScanHelpers &get() {
+        static ScanHelpers h;
+        return h;
+    }
+
+    void ensureThreads(uint64_t n) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        while (numThreads < n) {
+            std::thread([this]{
+                setThreadName("Scan helper");
+                loop();
+            }).detach();
+
+            numThreads++;
+        }
+    }
+
+    void loop() {
+        while (1) {
+            std::shared_ptr<Batch> batch;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{ return queue.size() > 0; });
+                batch = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            if (batch->next >= batch->jobs.size()) continue; // caller already took it
+
+            auto txn = env.txn_ro();
+            if (mdb_txn_id(txn.handle()) != batch->snapshotId) continue;
+
+            batch->runOne(txn);
+        }
+    }
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <queue>
+
+#include "golpe.h"
+
+
+// Sorts more records than fit in memory. Records are ordered by their first keySize bytes, compared
+// with memcmp. They are buffered until maxBufferBytes is reached, and then sorted and spilled to a
+// temporary file (a "run") in dir. merge() calls back with every record in order, by merging the runs.
+// The temporary files are unlinked as soon as they are created, so they never outlive the process.
+
+struct ExternalSorter : NonCopyable {
+    ExternalSorter(std::string dir, size_t keySize, uint64_t maxBufferBytes) : dir(dir), keySize(keySize), maxBufferBytes(maxBufferBytes) {}
+
+    ~ExternalSorter() {
+        for (auto *f : runs) fclose(f);
+    }
+
+    void add(std::string rec) {
+        if (rec.size() < keySize) throw herr("record smaller than sort key");
+
+        bufferBytes += rec.size() + sizeof(std::string);
+        buffer.emplace_back(std::move(rec));
+
+        if (bufferBytes >= maxBufferBytes) spill();
+    }
+
+    size_t numRuns() {
+        return runs.size();
+    }
+
+    // cb(std::string_view rec) is called for every record, in order. Can only be called once.
+
+    template<typename F>
+    void merge(F cb) {
+        if (runs.empty()) {
+            sortBuffer();
+            for (const auto &rec : buffer) cb(std::string_view(rec));
+            buffer.clear();
+            return;
+        }
+
+        spill();
+
+        std::vector<std::string> heads(runs.size());
+
+        auto cmp = [&](size_t a, size_t b){ return less(heads[b], heads[a]); }; // min-heap
+        std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> queue(cmp);
+
+        for (size_t i = 0; i < runs.size(); i++) {
+            rewind(runs[i]);
+            if (readRecord(runs[i], heads[i])) queue.push(i);
+        }
+
+        while (queue.size()) {
+            size_t i = queue.top();
+            queue.pop();
+
+            cb(std::string_view(heads[i]));
+
+            if (readRecord(runs[i], heads[i])) queue.push(i);
+        }
+    }
+
+  private:
+    std::string dir;
+    size_t keySize;
+    uint64_t maxBufferBytes;
+
+    std::vector<std::string> buffer;
+    uint64_t bufferBytes = 0;
+    std::vector<FILE*> runs;
+
+    bool less(std::string_view a, std::string_view b) {
+        return memcmp(a.data(), b.data(), keySize) < 0;
+    }
+
+    void sortBuffer() {
+        std::sort(buffer.begin(), buffer.end(), [&](const auto &a, const auto &b){ return less(a, b); });
+    }
+
+    void spill() {
+        if (buffer.empty()) return;
+
+        sortBuffer();
+
+        std::string path = dir + "/strfry-sort-XXXXXX";
+        int fd = mkstemp(path.data());
+        if (fd < 0) throw herr("couldn't create temp file in ", dir, ": ", strerror(errno));
+        unlink(path.c_str());
+
+        FILE *f = fdopen(fd, "w+");
+        if (!f) {
+            ::close(fd);
+            throw herr("fdopen failed: ", strerror(errno));
+        }
+
+        setvbuf(f, nullptr, _IOFBF, 1 << 20);
+        runs.push_back(f);
+
+        for (const auto &rec : buffer) {
+            uint32_t len = rec.size();
+            if (fwrite(&len, sizeof(len), 1, f) != 1 || fwrite(rec.data(), 1, rec.size(), f) != rec.size()) throw herr("error writing temp file: ", strerror(errno));
+        }
+
+        if (fflush(f)) throw herr("error writing temp file: ", strerror(errno));
+
+        buffer.clear();
+        bufferBytes = 0;
+    }
+
+    static bool readRecord(FILE *f, std::string &rec) {
+        uint32_t len;
+        if (fread(&len, sizeof(len), 1, f) != 1) {
+            if (ferror(f)) throw herr("error reading temp file");
+            return false;
+        }
+
+        rec.resize(len);
+        if (fread(rec.data(), 1, len, f) != len) throw herr("truncated temp file");
+
+        return true;
+    }
+};
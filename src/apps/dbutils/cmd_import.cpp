@@ -1,37 +1,381 @@
 #include <iostream>
+#include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <endian.h>
 
 #include <docopt.h>
+#include <hoytech/protected_queue.h>
 #include "golpe.h"
 
 #include "events.h"
 #include "filters.h"
+#include "IndexStats.h"
+#include "ExternalSorter.h"
 
 
 static const char USAGE[] =
 R"(
     Usage:
-      import [--show-rejected] [--no-verify]
+      import [--show-rejected] [--no-verify] [--threads=<threads>] [--bulk] [--bulk-sort-buffer=<bytes>]
 )";
 
 
+// Lines are read on one thread and parsed/verified in chunks by the worker threads. Chunks are
+// handed to workers round-robin, and since each worker processes its chunks in order, the writer
+// can collect the results in input order by taking them from the workers round-robin as well.
+
+static const size_t CHUNK_LINES = 1'000;
+static const size_t MAX_CHUNKS_IN_FLIGHT_PER_THREAD = 4;
+static const size_t WRITE_BATCH_SIZE = 10'000;
+
+struct ImportChunk {
+    uint64_t firstLine = 0;
+    std::vector<std::string> lines;
+    bool eof = false;
+};
+
+struct ImportResult {
+    std::vector<EventToWrite> events;
+    uint64_t processed = 0;
+    uint64_t rejected = 0;
+    bool eof = false;
+};
+
+// Shared by the reader, workers, and writer. If the writer fails, the workers are stopped and joined,
+// but the reader may be blocked reading stdin where it can't be interrupted. So it is detached, and
+// holds a reference to this until it notices stopping and exits.
+
+struct ImportQueues {
+    std::vector<hoytech::protected_queue<ImportChunk>> inboxes;
+    std::vector<hoytech::protected_queue<ImportResult>> outboxes;
+
+    std::mutex inFlightMutex;
+    std::condition_variable inFlightCv;
+    uint64_t inFlight = 0;
+    bool stopping = false; // protected by inFlightMutex
+
+    ImportQueues(uint64_t numThreads) : inboxes(numThreads), outboxes(numThreads) {}
+
+    bool isStopping() {
+        std::lock_guard<std::mutex> lk(inFlightMutex);
+        return stopping;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(inFlightMutex);
+            stopping = true;
+        }
+
+        inFlightCv.notify_all();
+        for (auto &inbox : inboxes) inbox.push_move(ImportChunk{ 0, {}, true });
+    }
+};
+
+
+// Used by --bulk, for loading into an empty DB. Instead of looking up each event in the DB as it
+// is written, events are sorted by id on disk, which brings duplicates together. Meanwhile
+// deletions and the newest version of each replaceable event are collected in memory. Once all
+// events have been added, the remaining ones are sorted by created_at and inserted in that order,
+// so levIds are ascending and EventPayload can be appended to.
+//
+// Unlike incremental imports, the outcome doesn't depend on input order: an event referenced by
+// a kind 5 deletion from the same pubkey is always dropped, and of each replaceable event only the
+// newest version is kept (even if that version was itself deleted).
+
+static const uint64_t BULK_SORT_BUFFER_BYTES = 512ULL * 1024 * 1024; // default, see --bulk-sort-buffer
+static const uint64_t BULK_COMMIT_SIZE = 100'000;
+
+struct BulkLoader {
+    std::string tmpDir;
+    uint64_t sortBufferBytes;
+
+    // Records are: id (32 bytes), receivedAt (uint64), flatStr size (uint32), flatStr, jsonStr
+    ExternalSorter byId;
+
+    flat_hash_set<std::string> deletions; // eventId + pubkey, same as the Event__deletion index
+
+    struct Newest {
+        uint64_t created_at;
+        std::string id;
+    };
+
+    flat_hash_map<std::string, Newest> newest; // pubkey + d tag + kind -> newest version
+
+    uint64_t added = 0, dups = 0, deleted = 0, replaced = 0;
+
+    BulkLoader(const std::string &tmpDir, uint64_t sortBufferBytes) : tmpDir(tmpDir), sortBufferBytes(sortBufferBytes), byId(tmpDir, 32, sortBufferBytes) {}
+
+    void add(EventToWrite &&ev) {
+        auto *flat = flatStrToFlatEvent(ev.flatStr);
+
+        if (flat->kind() == 5) {
+            for (const auto &tagPair : *(flat->tagsFixed32())) {
+                if (tagPair->key() == 'e') deletions.insert(std::string(sv(tagPair->val())) + std::string(sv(flat->pubkey())));
+            }
+        }
+
+        if (auto key = replaceKey(flat)) {
+            auto res = newest.try_emplace(*key, Newest{ flat->created_at(), std::string(sv(flat->id())) });
+            auto &n = res.first->second;
+
+            // Same rule as writeEvents
+            if (!res.second && (n.created_at < flat->created_at() || (n.created_at == flat->created_at() && sv(flat->id()) < n.id))) {
+                n = Newest{ flat->created_at(), std::string(sv(flat->id())) };
+            }
+        }
+
+        uint64_t receivedAt = ev.receivedAt;
+        uint32_t flatSize = ev.flatStr.size();
+
+        std::string rec;
+        rec.reserve(32 + 8 + 4 + ev.flatStr.size() + ev.jsonStr.size());
+        rec += sv(flat->id());
+        rec += lmdb::to_sv<uint64_t>(receivedAt);
+        rec += lmdb::to_sv<uint32_t>(flatSize);
+        rec += ev.flatStr;
+        rec += ev.jsonStr;
+
+        byId.add(std::move(rec));
+    }
+
+    void write(lmdb::txn &txn) {
+        LI << "Resolving duplicates, deletions, and replacements (" << byId.numRuns() << " sorted runs)";
+
+        // Records are: created_at (big-endian uint64), followed by a byId record
+        ExternalSorter byCreatedAt(tmpDir, 8 + 32, sortBufferBytes);
+
+        std::string prevId;
+        uint64_t toWrite = 0;
+
+        byId.merge([&](std::string_view rec){
+            auto id = rec.substr(0, 32);
+
+            if (id == prevId) {
+                dups++;
+                return;
+            }
+
+            prevId = id;
+
+            std::string flatStr(flatFromRecord(rec));
+            auto *flat = flatStrToFlatEvent(flatStr);
+
+            if (deletions.contains(std::string(id) + std::string(sv(flat->pubkey())))) {
+                deleted++;
+                return;
+            }
+
+            if (auto key = replaceKey(flat); key && newest.at(*key).id != id) {
+                replaced++;
+                return;
+            }
+
+            uint64_t createdAtBE = htobe64(flat->created_at());
+
+            std::string out;
+            out.reserve(8 + rec.size());
+            out += lmdb::to_sv<uint64_t>(createdAtBE);
+            out += rec;
+
+            byCreatedAt.add(std::move(out));
+            toWrite++;
+        });
+
+        deletions.clear();
+        newest.clear();
+
+        LI << "Writing events (" << byCreatedAt.numRuns() << " sorted runs)";
+
+        // The DB is empty, so the index statistics can be sized for what's about to be written, instead of needing a rebuild later
+        IndexStats::reset(txn, IndexStats::bucketBitsFor(toWrite));
+        IndexStats::Delta statsDelta(txn);
+        std::string payload;
+        uint64_t numInBatch = 0;
+
+        byCreatedAt.merge([&](std::string_view rec){
+            rec = rec.substr(8);
+
+            uint64_t receivedAt = lmdb::from_sv<uint64_t>(rec.substr(32, 8));
+            std::string flatStr(flatFromRecord(rec));
+
+            uint64_t levId = env.insert_Event(txn, receivedAt, flatStr, (uint64_t)EventSourceType::Import, "");
+
+            payload.clear();
+            payload += '\x00';
+            payload += jsonFromRecord(rec);
+            env.dbi_EventPayload.put(txn, lmdb::to_sv<uint64_t>(levId), payload, MDB_APPEND);
+
+            statsDelta.addEvent(flatStrToFlatEvent(flatStr), 1);
+            added++;
+
+            if (++numInBatch >= BULK_COMMIT_SIZE) {
+                statsDelta.apply(txn);
+                txn.commit();
+                txn = env.txn_rw();
+                numInBatch = 0;
+
+                LI << "Committed " << added << " records";
+            }
+        });
+
+        statsDelta.apply(txn);
+    }
+
+  private:
+    static std::optional<std::string> replaceKey(const NostrIndex::Event *flat) {
+        if (!isReplaceableKind(flat->kind()) && !isParamReplaceableKind(flat->kind())) return std::nullopt;
+
+        for (const auto &tagPair : *(flat->tagsGeneral())) {
+            if ((char)tagPair->key() != 'd') continue;
+            return makeKey_StringUint64(std::string(sv(flat->pubkey())) + std::string(sv(tagPair->val())), flat->kind());
+        }
+
+        return std::nullopt;
+    }
+
+    static std::string_view flatFromRecord(std::string_view rec) {
+        uint32_t flatSize = lmdb::from_sv<uint32_t>(rec.substr(40, 4));
+        return rec.substr(44, flatSize);
+    }
+
+    static std::string_view jsonFromRecord(std::string_view rec) {
+        uint32_t flatSize = lmdb::from_sv<uint32_t>(rec.substr(40, 4));
+        return rec.substr(44 + flatSize);
+    }
+};
+
+
 void cmd_import(const std::vector<std::string> &subArgs) {
     std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
 
     bool showRejected = args["--show-rejected"].asBool();
     bool noVerify = args["--no-verify"].asBool();
+    bool bulkMode = args["--bulk"].asBool();
+    uint64_t numThreads = 1;
+    if (args["--threads"]) numThreads = args["--threads"].asLong();
+    if (numThreads < 1) throw herr("--threads must be at least 1");
+    uint64_t sortBufferBytes = BULK_SORT_BUFFER_BYTES;
+    if (args["--bulk-sort-buffer"]) sortBufferBytes = args["--bulk-sort-buffer"].asLong();
+    if (sortBufferBytes < 1) throw herr("--bulk-sort-buffer must be at least 1");
 
     if (noVerify) LW << "not verifying event IDs or signatures!";
 
     auto txn = env.txn_rw();
 
-    secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+    std::optional<BulkLoader> bulk;
+
+    if (bulkMode) {
+        if (getMostRecentLevId(txn) != 0) throw herr("--bulk can only be used with an empty DB");
+        bulk.emplace(dbDir, sortBufferBytes);
+    }
+
+
+    auto queues = std::make_shared<ImportQueues>(numThreads);
+
+
+    std::thread readerThread([queues, numThreads]{
+        setThreadName("Reader");
+
+        auto &q = *queues;
+
+        std::string line;
+        uint64_t lineNum = 0;
+        uint64_t chunkNum = 0;
+
+        ImportChunk chunk;
+        chunk.firstLine = 1;
+
+        // Returns false if the import is stopping
+        auto sendChunk = [&]{
+            {
+                std::unique_lock<std::mutex> lk(q.inFlightMutex);
+                q.inFlightCv.wait(lk, [&]{ return q.stopping || q.inFlight < numThreads * MAX_CHUNKS_IN_FLIGHT_PER_THREAD; });
+                if (q.stopping) return false;
+                q.inFlight++;
+            }
+
+            q.inboxes[chunkNum++ % numThreads].push_move(std::move(chunk));
+
+            chunk = ImportChunk{};
+            chunk.firstLine = lineNum + 1;
+
+            return true;
+        };
+
+        while (std::getline(std::cin, line)) {
+            if (!line.size()) continue;
+
+            lineNum++;
+            chunk.lines.emplace_back(std::move(line));
+
+            if (chunk.lines.size() >= CHUNK_LINES && !sendChunk()) return;
+        }
+
+        if (chunk.lines.size() && !sendChunk()) return;
+
+        for (auto &inbox : q.inboxes) inbox.push_move(ImportChunk{ 0, {}, true });
+    });
+
+
+    std::vector<std::thread> workerThreads;
+
+    for (uint64_t threadId = 0; threadId < numThreads; threadId++) {
+        workerThreads.emplace_back([&, threadId]{
+            setThreadName((std::string("Import ") + std::to_string(threadId)).c_str());
+
+            secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+            ParsedEvent ev;
+
+            while (1) {
+                auto chunks = queues->inboxes[threadId].pop_all();
+
+                for (auto &chunk : chunks) {
+                    if (chunk.eof || queues->isStopping()) {
+                        queues->outboxes[threadId].push_move(ImportResult{ {}, 0, 0, true });
+                        secp256k1_context_destroy(secpCtx);
+                        return;
+                    }
+
+                    ImportResult res;
+                    res.processed = chunk.lines.size();
+
+                    for (size_t i = 0; i < chunk.lines.size(); i++) {
+                        std::string flatStr;
+                        std::string jsonStr;
+
+                        try {
+                            parseEventJson(chunk.lines[i], ev);
+                            parseAndVerifyEvent(ev, secpCtx, !noVerify, false, flatStr, jsonStr);
+                        } catch (std::exception &e) {
+                            if (showRejected) LW << "Line " << (chunk.firstLine + i) << " rejected: " << e.what();
+                            res.rejected++;
+                            continue;
+                        }
+
+                        res.events.emplace_back(std::move(flatStr), std::move(jsonStr), hoytech::curr_time_us(), EventSourceType::Import, "");
+                    }
+
+                    queues->outboxes[threadId].push_move(std::move(res));
+                }
+            }
+        });
+    }
+
+
+    // Writer
 
-    std::string line;
     uint64_t processed = 0, added = 0, rejected = 0, dups = 0;
     std::vector<EventToWrite> newEvents;
+    auto startTime = hoytech::curr_time_us();
 
     auto logStatus = [&]{
-        LI << "Processed " << processed << " lines. " << added << " added, " << rejected << " rejected, " << dups << " dups";
+        uint64_t elapsed = hoytech::curr_time_us() - startTime;
+        uint64_t rate = elapsed ? processed * 1'000'000 / elapsed : 0;
+
+        LI << "Processed " << processed << " lines. " << added << " added, " << rejected << " rejected, " << dups << " dups (" << rate << " events/sec)";
     };
 
     auto flushChanges = [&]{
@@ -59,31 +403,58 @@ void cmd_import(const std::vector<std::string> &subArgs) {
         newEvents.clear();
     };
 
+    std::vector<std::deque<ImportResult>> pendingResults(numThreads);
+
+    try {
+        for (uint64_t chunkNum = 0; ; chunkNum++) {
+            auto &pending = pendingResults[chunkNum % numThreads];
+            if (pending.empty()) pending = queues->outboxes[chunkNum % numThreads].pop_all();
 
-    while (std::cin) {
-        std::getline(std::cin, line);
-        if (!line.size()) continue;
+            auto res = std::move(pending.front());
+            pending.pop_front();
 
-        processed++;
+            if (res.eof) break;
+
+            {
+                std::lock_guard<std::mutex> lk(queues->inFlightMutex);
+                queues->inFlight--;
+            }
+            queues->inFlightCv.notify_one();
 
-        std::string flatStr;
-        std::string jsonStr;
+            processed += res.processed;
+            rejected += res.rejected;
 
-        try {
-            auto origJson = tao::json::from_string(line);
-            parseAndVerifyEvent(origJson, secpCtx, !noVerify, false, flatStr, jsonStr);
-        } catch (std::exception &e) {
-            if (showRejected) LW << "Line " << processed << " rejected: " << e.what();
-            rejected++;
-            continue;
+            if (bulk) {
+                for (auto &ev : res.events) bulk->add(std::move(ev));
+                if (processed % 1'000'000 < res.processed) logStatus();
+                continue;
+            }
+
+            for (auto &ev : res.events) newEvents.emplace_back(std::move(ev));
+
+            if (newEvents.size() >= WRITE_BATCH_SIZE) flushChanges();
         }
 
-        newEvents.emplace_back(std::move(flatStr), std::move(jsonStr), hoytech::curr_time_us(), EventSourceType::Import, "");
+        if (bulk) {
+            bulk->write(txn);
 
-        if (newEvents.size() >= 10'000) flushChanges();
-    }
+            added = bulk->added;
+            dups = bulk->dups;
+            rejected += bulk->deleted + bulk->replaced;
+            logStatus();
+            LI << "Bulk load: " << bulk->deleted << " deleted, " << bulk->replaced << " replaced";
+        } else {
+            flushChanges();
+        }
 
-    flushChanges();
+        txn.commit();
+    } catch (...) {
+        queues->stop();
+        for (auto &t : workerThreads) t.join();
+        readerThread.detach(); // see ImportQueues
+        throw;
+    }
 
-    txn.commit();
+    readerThread.join();
+    for (auto &t : workerThreads) t.join();
 }
@@ -4,13 +4,18 @@
 #include "golpe.h"
 
 #include "DBQuery.h"
+#include "QueryCache.h"
 #include "events.h"
 
 
 static const char USAGE[] =
 R"(
     Usage:
-      scan [--pause=<pause>] [--metrics] [--count] <filter>
+      scan [--pause=<pause>] [--metrics] [--count] [--via-cache=<behind>] <filter>
+
+    Options:
+      --via-cache=<behind>  Scan as if the latest <behind> events hadn't been written yet, put the results in a
+                            REQ cache, and output what the cache returns once those events are merged in. For testing.
 )";
 
 
@@ -36,6 +41,35 @@ void cmd_scan(const std::vector<std::string> &subArgs) {
 
     exitOnSigPipe();
 
+    if (args["--via-cache"]) {
+        uint64_t behind = args["--via-cache"].asLong();
+        uint64_t currEventId = getMostRecentLevId(txn);
+
+        query.sub.latestEventId = currEventId > behind ? currEventId - behind : 0;
+        query.recordResults = true;
+
+        while (!query.process(txn, [](const auto &, uint64_t){})) {}
+
+        QueryCache cache;
+        cache.maxEntries = 1;
+        cache.maxExtendEvents = MAX_U64;
+
+        const auto &fg = query.sub.filterGroup;
+        std::string key = fg.canonicalKey();
+        cache.insert(key, query.sub.latestEventId, std::move(query.filterResults));
+
+        std::vector<uint64_t> levIds;
+        if (!cache.lookup(txn, fg, key, currEventId, levIds)) throw herr("REQ cache lookup failed");
+
+        for (auto levId : levIds) {
+            if (count) numEvents++;
+            else std::cout << getEventJson(txn, decomp, levId) << "\n";
+        }
+
+        if (count) std::cout << numEvents << std::endl;
+        return;
+    }
+
     while (1) {
         bool complete = query.process(txn, [&](const auto &sub, uint64_t levId){
             if (count) numEvents++;
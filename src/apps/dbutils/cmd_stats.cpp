@@ -0,0 +1,41 @@
+#include <iostream>
+
+#include <docopt.h>
+#include "golpe.h"
+
+#include "IndexStats.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      stats [--rebuild]
+)";
+
+
+void cmd_stats(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    if (args["--rebuild"].asBool()) {
+        auto txn = env.txn_rw();
+
+        LI << "Building index statistics, this may take a while...";
+        IndexStats::rebuild(txn);
+
+        txn.commit();
+        return;
+    }
+
+    auto txn = env.txn_ro();
+
+    uint64_t bits = IndexStats::bucketBits(txn);
+
+    if (!bits) {
+        std::cout << "Index statistics: not built\n";
+        return;
+    }
+
+    std::cout << "Index statistics: " << (1ULL << bits) << " buckets per row";
+    if (IndexStats::outgrown(txn)) std::cout << " (too small for this DB, rebuild with --rebuild)";
+    std::cout << "\n";
+}
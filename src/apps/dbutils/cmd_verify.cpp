@@ -0,0 +1,72 @@
+#include <iostream>
+
+#include <docopt.h>
+#include "golpe.h"
+
+#include "events.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      verify [--no-verify] [--message] [--via-value]
+
+    Options:
+      --message    Each line is an ["EVENT", {...}] message, as sent by clients
+      --via-value  Parse each line into a tao::json value first, and then read the event from that. For
+                   testing that it gives the same results as the parser used by import and the relay.
+)";
+
+
+// Checks events from stdin without writing them to the DB. For each line, outputs the id computed from
+// its fields and its normalised JSON, or why it was rejected.
+
+void cmd_verify(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    bool noVerify = args["--no-verify"].asBool();
+    bool message = args["--message"].asBool();
+    bool viaValue = args["--via-value"].asBool();
+
+    secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+
+    exitOnSigPipe();
+
+    std::string line;
+
+    while (std::getline(std::cin, line)) {
+        if (!line.size()) continue;
+
+        ParsedEvent ev;
+        std::string flatStr;
+        std::string jsonStr;
+
+        try {
+            if (!viaValue) {
+                if (message) parseEventMessage(line, ev);
+                else parseEventJson(line, ev);
+            } else {
+                auto json = tao::json::from_string(line);
+
+                if (message) {
+                    if (!json.is_array()) throw herr("message is not an array");
+                    auto &arr = json.get_array();
+                    if (arr.size() < 2) throw herr("bad message");
+                    if (arr[0] != "EVENT") throw herr("not an EVENT message");
+                    parseEventValue(arr[1], ev);
+                } else {
+                    parseEventValue(json, ev);
+                }
+            }
+
+            parseAndVerifyEvent(ev, secpCtx, !noVerify, false, flatStr, jsonStr);
+        } catch (std::exception &e) {
+            std::cout << "rejected: " << e.what() << "\n";
+            continue;
+        }
+
+        std::cout << to_hex(nostrHash(ev)) << " " << jsonStr << "\n";
+    }
+
+    secp256k1_context_destroy(secpCtx);
+}
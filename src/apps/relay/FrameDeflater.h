@@ -0,0 +1,49 @@
+#pragma once
+
+#include <zlib.h>
+
+#include "golpe.h"
+
+
+// Compresses websocket message payloads for permessage-deflate (RFC 7692), independently of any
+// connection's compression state. Each call produces a self-contained raw deflate stream ending in
+// a sync flush, so the outputs of several calls can be concatenated into one message, as long as
+// the trailing 00 00 ff ff is removed from the final one. Only valid for connections without a
+// sliding window, since otherwise the connection's own compressor expects the client's window to
+// contain only what it has sent.
+
+struct FrameDeflater : NonCopyable {
+    z_stream strm = {};
+
+    FrameDeflater() {
+        // Same parameters as uWS uses for its own compression
+        if (deflateInit2(&strm, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) throw herr("deflateInit2 failed");
+    }
+
+    ~FrameDeflater() {
+        deflateEnd(&strm);
+    }
+
+    // Appends to output
+
+    void compress(std::string_view input, std::string &output) {
+        deflateReset(&strm);
+
+        size_t origSize = output.size();
+        output.resize(origSize + deflateBound(&strm, input.size()) + 16); // + room for the sync flush
+
+        strm.next_in = (Bytef*)input.data();
+        strm.avail_in = input.size();
+        strm.next_out = (Bytef*)output.data() + origSize;
+        strm.avail_out = output.size() - origSize;
+
+        if (deflate(&strm, Z_SYNC_FLUSH) != Z_OK || strm.avail_in || strm.avail_out == 0) throw herr("deflate failed");
+
+        output.resize(output.size() - strm.avail_out);
+    }
+
+    static void removeTrailer(std::string &output) {
+        if (!output.ends_with(std::string_view("\x00\x00\xff\xff", 4))) throw herr("unexpected deflate trailer");
+        output.resize(output.size() - 4);
+    }
+};
@@ -121,6 +121,54 @@ void RelayServer::runCron() {
     });
 
 
+    // REQ cache stats
+
+    cron.repeat(60 * 1'000'000UL, [&]{
+        if (!cfg().relay__logging__reqCacheStats) return;
+
+        auto &c = reqCacheStats;
+
+        LI << "REQ cache: entries=" << c.entries << " hits=" << c.hits << " extended=" << c.extended
+           << " misses=" << c.misses << " invalidated=" << c.invalidated;
+    });
+
+
+    // Hot event cache stats
+
+    cron.repeat(60 * 1'000'000UL, [&]{
+        if (!cfg().relay__logging__hotEventCacheStats) return;
+
+        auto &c = globalHotEventCache;
+        uint64_t hits = c.hits, misses = c.misses;
+
+        LI << "Hot event cache: entries=" << c.entries << " bytes=" << renderSize(c.bytes)
+           << " hits=" << hits << " misses=" << misses << " evictions=" << c.evictions
+           << " hitRate=" << renderPercent(hits + misses ? (double)hits / (hits + misses) : 0.0);
+    });
+
+
+    // Backpressure
+
+    cron.repeat(60 * 1'000'000UL, [&, lastStuckConnsClosed = uint64_t(0)]() mutable {
+        uint64_t stuckConnsClosed = numStuckConnsClosed;
+        if (numPausedConns == 0 && stuckConnsClosed == lastStuckConnsClosed) return;
+
+        LI << "Websocket backpressure: queued=" << renderSize(websocketQueuedBytes) << " pausedConns=" << numPausedConns
+           << " stuckConnsClosed=" << (stuckConnsClosed - lastStuckConnsClosed);
+
+        lastStuckConnsClosed = stuckConnsClosed;
+    });
+
+
+    // Live event latency
+
+    cron.repeat(60 * 1'000'000UL, [&]{
+        if (!cfg().relay__logging__liveLatency) return;
+
+        LI << "Live event publish-to-send latency: " << publishToSendLatency.render();
+    });
+
+
 
     cron.run();
 
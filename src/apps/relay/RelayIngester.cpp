@@ -1,6 +1,20 @@
 #include "RelayServer.h"
 
 
+// EVENT messages are by far the most common, and are parsed directly into a ParsedEvent instead
+// of going through a DOM. Anything else (including an EVENT with an escaped command) takes the
+// general path.
+
+static bool isEventMessage(std::string_view payload) {
+    if (!payload.starts_with('[')) return false;
+    payload.remove_prefix(1);
+
+    while (payload.size() && (payload[0] == ' ' || payload[0] == '\t' || payload[0] == '\n' || payload[0] == '\r')) payload.remove_prefix(1);
+
+    return payload.starts_with("\"EVENT\"");
+}
+
+
 void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
     secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
     Decompressor decomp;
@@ -12,10 +26,30 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
 
         std::vector<MsgWriter> writerMsgs;
 
+        auto processEvent = [&](MsgIngester::ClientMessage *msg, auto parse){
+            ParsedEvent ev;
+
+            try {
+                parse(ev);
+                ingesterProcessEvent(txn, msg->connId, msg->ipAddr, secpCtx, ev, writerMsgs);
+            } catch (std::exception &e) {
+                if (ev.id.empty()) throw; // not enough of an event to send an OK for
+                sendOKResponse(msg->connId, ev.id, false, std::string("invalid: ") + e.what());
+                if (cfg().relay__logging__invalidEvents) LI << "Rejected invalid event: " << e.what();
+            }
+        };
+
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgIngester::ClientMessage>(&newMsg.msg)) {
                 try {
-                    if (msg->payload.starts_with('[')) {
+                    if (isEventMessage(msg->payload)) {
+                        if (cfg().relay__logging__dumpInAll) LI << "[" << msg->connId << "] dumpInAll: " << msg->payload; 
+                        if (cfg().relay__logging__dumpInEvents) LI << "[" << msg->connId << "] dumpInEvent: " << msg->payload; 
+
+                        processEvent(msg, [&](ParsedEvent &ev){
+                            parseEventMessage(msg->payload, ev);
+                        });
+                    } else if (msg->payload.starts_with('[')) {
                         auto payload = tao::json::from_string(msg->payload);
 
                         if (cfg().relay__logging__dumpInAll) LI << "[" << msg->connId << "] dumpInAll: " << msg->payload; 
@@ -29,12 +63,9 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                         if (cmd == "EVENT") {
                             if (cfg().relay__logging__dumpInEvents) LI << "[" << msg->connId << "] dumpInEvent: " << msg->payload; 
 
-                            try {
-                                ingesterProcessEvent(txn, msg->connId, msg->ipAddr, secpCtx, arr[1], writerMsgs);
-                            } catch (std::exception &e) {
-                                sendOKResponse(msg->connId, arr[1].at("id").get_string(), false, std::string("invalid: ") + e.what());
-                                if (cfg().relay__logging__invalidEvents) LI << "Rejected invalid event: " << e.what();
-                            }
+                            processEvent(msg, [&](ParsedEvent &ev){
+                                parseEventValue(arr[1], ev);
+                            });
                         } else if (cmd == "REQ") {
                             if (cfg().relay__logging__dumpInReqs) LI << "[" << msg->connId << "] dumpInReq: " << msg->payload; 
 
@@ -83,10 +114,10 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
     }
 }
 
-void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output) {
+void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const ParsedEvent &ev, std::vector<MsgWriter> &output) {
     std::string flatStr, jsonStr;
 
-    parseAndVerifyEvent(origJson, secpCtx, true, true, flatStr, jsonStr);
+    parseAndVerifyEvent(ev, secpCtx, true, true, flatStr, jsonStr);
 
     auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(flatStr.data());
 
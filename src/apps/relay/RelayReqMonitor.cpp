@@ -4,19 +4,103 @@
 
 
 
+// Upper bound on the number of events in a MonitorEventBatch, so a large import isn't held in memory all at once
+static const size_t MAX_BATCH_EVENTS = 1000;
+
+
 void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
+    // The Writer notifies us directly after each commit. This is for events added by other
+    // processes, such as strfry import, or other relays using the same DB.
+
     auto dbChangeWatcher = hoytech::file_change_monitor(dbDir + "/data.mdb");
 
     dbChangeWatcher.setDebounce(100);
 
     dbChangeWatcher.run([&](){
-        tpReqMonitor.dispatchToAll([]{ return MsgReqMonitor{MsgReqMonitor::DBChange{}}; });
+        tpReqMonitor.dispatch(thr.id, MsgReqMonitor{MsgReqMonitor::DBChange{}});
     });
 
 
     Decompressor decomp;
     ActiveMonitors monitors;
-    uint64_t currEventId = MAX_U64;
+    uint64_t currEventId = MAX_U64; // events up to here have been processed by monitors
+    uint64_t batchEventId = MAX_U64; // events up to here have been shared with the other threads (thread 0 only)
+
+    // Processes events after currEventId, up to and including upToEventId, by reading them from the DB
+
+    auto processFromDB = [&](lmdb::txn &txn, uint64_t upToEventId, uint64_t publishedAt){
+        env.foreach_Event(txn, [&](auto &ev){
+            if (ev.primaryKeyId > upToEventId) return false;
+
+            monitors.process(ev.primaryKeyId, ev.flat_nested(), [&](RecipientList &&recipients, uint64_t levId){
+                sendEventToBatch(std::move(recipients), globalHotEventCache.get(txn, decomp, levId), publishedAt);
+            });
+
+            return true;
+        }, false, currEventId + 1);
+
+        currEventId = upToEventId;
+    };
+
+    // Batches are built by thread 0 in order and each one starts where the previous ended, but this
+    // thread may have already read some of the events itself (for instance, if the option was just
+    // enabled), or be missing some (if it started after thread 0 built a batch). Missing events are
+    // read from the DB.
+
+    auto processBatch = [&](lmdb::txn &txn, const MonitorEventBatch &batch){
+        if (batch.latestEventId <= currEventId) return;
+        if (batch.afterEventId > currEventId) processFromDB(txn, batch.afterEventId, 0);
+
+        for (const auto &item : batch.events) {
+            if (item.levId <= currEventId) continue;
+
+            monitors.process(item.levId, flatStrToFlatEvent(item.flatStr), [&](RecipientList &&recipients, uint64_t){
+                sendEventToBatch(std::move(recipients), item.evJson, batch.publishedAt);
+            });
+        }
+
+        currEventId = batch.latestEventId;
+    };
+
+    auto shareBatch = [&](lmdb::txn &txn, std::shared_ptr<MonitorEventBatch> &&batch){
+        std::shared_ptr<const MonitorEventBatch> shared = std::move(batch);
+
+        for (size_t i = 1; i < tpReqMonitor.numThreads; i++) {
+            tpReqMonitor.dispatch(i, MsgReqMonitor{MsgReqMonitor::EventBatch{shared}});
+        }
+
+        processBatch(txn, *shared);
+    };
+
+    auto buildBatches = [&](lmdb::txn &txn, uint64_t latestEventId, uint64_t publishedAt){
+        auto batch = std::make_shared<MonitorEventBatch>();
+        batch->afterEventId = batchEventId;
+        batch->publishedAt = publishedAt;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            batch->events.emplace_back(MonitorEventBatch::Item{
+                ev.primaryKeyId,
+                std::string(ev.flat()),
+                globalHotEventCache.get(txn, decomp, ev.primaryKeyId),
+            });
+
+            if (batch->events.size() >= MAX_BATCH_EVENTS) {
+                batch->latestEventId = ev.primaryKeyId;
+                shareBatch(txn, std::move(batch));
+
+                batch = std::make_shared<MonitorEventBatch>();
+                batch->afterEventId = ev.primaryKeyId;
+                batch->publishedAt = publishedAt;
+            }
+
+            return true;
+        }, false, batchEventId + 1);
+
+        batch->latestEventId = latestEventId;
+        if (batch->latestEventId > batch->afterEventId) shareBatch(txn, std::move(batch));
+
+        batchEventId = latestEventId;
+    };
 
     while (1) {
         auto newMsgs = thr.inbox.pop_all();
@@ -25,6 +109,7 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
 
         uint64_t latestEventId = getMostRecentLevId(txn);
         if (currEventId > latestEventId) currEventId = latestEventId;
+        if (batchEventId > latestEventId) batchEventId = latestEventId;
 
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgReqMonitor::NewSub>(&newMsg.msg)) {
@@ -32,7 +117,7 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
 
                 env.foreach_Event(txn, [&](auto &ev){
                     if (msg->sub.filterGroup.doesMatch(ev.flat_nested())) {
-                        sendEvent(connId, msg->sub.subId, getEventJson(txn, decomp, ev.primaryKeyId));
+                        sendEvent(connId, msg->sub.subId, *globalHotEventCache.get(txn, decomp, ev.primaryKeyId));
                     }
 
                     return true;
@@ -47,15 +132,15 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
                 monitors.removeSub(msg->connId, msg->subId);
             } else if (auto msg = std::get_if<MsgReqMonitor::CloseConn>(&newMsg.msg)) {
                 monitors.closeConn(msg->connId);
-            } else if (std::get_if<MsgReqMonitor::DBChange>(&newMsg.msg)) {
-                env.foreach_Event(txn, [&](auto &ev){
-                    monitors.process(txn, ev, [&](RecipientList &&recipients, uint64_t levId){
-                        sendEventToBatch(std::move(recipients), std::string(getEventJson(txn, decomp, levId)));
-                    });
-                    return true;
-                }, false, currEventId + 1);
-
-                currEventId = latestEventId;
+            } else if (auto msg = std::get_if<MsgReqMonitor::DBChange>(&newMsg.msg)) {
+                if (!cfg().relay__monitorSharedBatches) {
+                    processFromDB(txn, latestEventId, msg->publishedAt);
+                    batchEventId = latestEventId;
+                } else if (thr.id == 0) {
+                    buildBatches(txn, latestEventId, msg->publishedAt);
+                }
+            } else if (auto msg = std::get_if<MsgReqMonitor::EventBatch>(&newMsg.msg)) {
+                processBatch(txn, *msg->batch);
             }
         }
     }
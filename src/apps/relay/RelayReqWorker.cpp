@@ -5,13 +5,27 @@
 void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
     Decompressor decomp;
     QueryScheduler queries;
+    queries.cache.stats = &reqCacheStats;
+
+    // Everything found during a timeslice is sent to the websocket thread together
+
+    std::vector<MsgWebsocket::Send> pendingSends;
+
+    auto flushSends = [&]{
+        sendToConnBatch(std::move(pendingSends));
+        pendingSends.clear();
+    };
 
     queries.onEvent = [&](lmdb::txn &txn, const auto &sub, uint64_t levId, std::string_view eventPayload){
-        sendEvent(sub.connId, sub.subId, decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr));
+        pendingSends.emplace_back(MsgWebsocket::Send{sub.connId, renderEvent(sub.subId, *globalHotEventCache.get(txn, decomp, levId, eventPayload))});
     };
 
     queries.onComplete = [&](lmdb::txn &, Subscription &sub){
-        sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "EOSE", sub.subId.str() })));
+        pendingSends.emplace_back(MsgWebsocket::Send{sub.connId, tao::json::to_string(tao::json::value::array({ "EOSE", sub.subId.str() }))});
+
+        // Must be sent before the ReqMonitor can send any new events
+        flushSends();
+
         tpReqMonitor.dispatch(sub.connId, MsgReqMonitor{MsgReqMonitor::NewSub{std::move(sub)}});
     };
 
@@ -20,6 +34,11 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
 
         auto txn = env.txn_ro();
 
+        queries.shareScans = cfg().relay__shareScans;
+        queries.maxQueryParallelism = cfg().relay__maxQueryParallelism;
+        queries.cache.maxEntries = cfg().relay__reqCache__maxEntries;
+        queries.cache.maxExtendEvents = cfg().relay__reqCache__maxExtendEvents;
+
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgReqWorker::NewSub>(&newMsg.msg)) {
                 auto connId = msg->sub.connId;
@@ -35,10 +54,15 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
             } else if (auto msg = std::get_if<MsgReqWorker::CloseConn>(&newMsg.msg)) {
                 queries.closeConn(msg->connId);
                 tpReqMonitor.dispatch(msg->connId, MsgReqMonitor{MsgReqMonitor::CloseConn{msg->connId}});
+            } else if (auto msg = std::get_if<MsgReqWorker::PauseConn>(&newMsg.msg)) {
+                queries.pauseConn(msg->connId);
+            } else if (auto msg = std::get_if<MsgReqWorker::ResumeConn>(&newMsg.msg)) {
+                queries.resumeConn(msg->connId);
             }
         }
 
         queries.process(txn);
+        flushSends();
 
         txn.abort();
     }
@@ -17,6 +17,9 @@
 #include "events.h"
 #include "filters.h"
 #include "Decompressor.h"
+#include "HotEventCache.h"
+#include "QueryCache.h"
+#include "LatencyHistogram.h"
 
 
 
@@ -32,15 +35,20 @@ struct MsgWebsocket : NonCopyable {
         std::string payload;
     };
 
+    struct SendBatch {
+        std::vector<Send> items;
+    };
+
     struct SendEventToBatch {
         RecipientList list;
-        std::string evJson;
+        EventJson evJson;
+        uint64_t publishedAt; // when the Writer committed the event (0 if unknown)
     };
 
     struct GracefulShutdown {
     };
 
-    using Var = std::variant<Send, SendBinary, SendEventToBatch, GracefulShutdown>;
+    using Var = std::variant<Send, SendBinary, SendBatch, SendEventToBatch, GracefulShutdown>;
     Var msg;
     MsgWebsocket(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -93,11 +101,35 @@ struct MsgReqWorker : NonCopyable {
         uint64_t connId;
     };
 
-    using Var = std::variant<NewSub, RemoveSub, CloseConn>;
+    // Sent by the websocket thread when too much is queued to be sent to the connection
+    struct PauseConn {
+        uint64_t connId;
+    };
+
+    struct ResumeConn {
+        uint64_t connId;
+    };
+
+    using Var = std::variant<NewSub, RemoveSub, CloseConn, PauseConn, ResumeConn>;
     Var msg;
     MsgReqWorker(Var &&msg_) : msg(std::move(msg_)) {}
 };
 
+// New events read once from the DB and shared by all ReqMonitor threads (see relay__monitorSharedBatches)
+
+struct MonitorEventBatch {
+    struct Item {
+        uint64_t levId;
+        std::string flatStr;
+        EventJson evJson;
+    };
+
+    uint64_t afterEventId; // the events are all those after this levId, up to and including latestEventId
+    uint64_t latestEventId;
+    uint64_t publishedAt; // see MsgReqMonitor::DBChange
+    std::vector<Item> events;
+};
+
 struct MsgReqMonitor : NonCopyable {
     struct NewSub {
         Subscription sub;
@@ -113,9 +145,14 @@ struct MsgReqMonitor : NonCopyable {
     };
 
     struct DBChange {
+        uint64_t publishedAt = 0; // when the Writer committed, or 0 if from the file watcher
+    };
+
+    struct EventBatch {
+        std::shared_ptr<const MonitorEventBatch> batch;
     };
 
-    using Var = std::variant<NewSub, RemoveSub, CloseConn, DBChange>;
+    using Var = std::variant<NewSub, RemoveSub, CloseConn, DBChange, EventBatch>;
     Var msg;
     MsgReqMonitor(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -149,7 +186,22 @@ struct MsgNegentropy : NonCopyable {
 
 
 struct RelayServer {
-    uS::Async *hubTrigger = nullptr;
+    struct HubTrigger {
+        uS::Async *async = nullptr;
+        std::atomic<bool> pending = false;
+    };
+
+    std::deque<HubTrigger> hubTriggers; // one per websocket thread
+    std::atomic<uint64_t> numWebsocketThreadsShutdown = 0; // threads with no connections left after a graceful shutdown
+
+    // Backpressure metrics, see runWebsocket()
+    std::atomic<uint64_t> websocketQueuedBytes = 0;
+    std::atomic<uint64_t> numPausedConns = 0;
+    std::atomic<uint64_t> numStuckConnsClosed = 0;
+
+    LatencyHistogram publishToSendLatency; // from Writer commit to websocket send, for live events
+
+    QueryCache::Stats reqCacheStats; // shared by the REQ caches of all ReqWorker threads
 
     // Thread Pools
 
@@ -167,7 +219,7 @@ struct RelayServer {
     void runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr);
 
     void runIngester(ThreadPool<MsgIngester>::Thread &thr);
-    void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output);
+    void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, std::string ipAddr, secp256k1_context *secpCtx, const ParsedEvent &ev, std::vector<MsgWriter> &output);
     void ingesterProcessReq(lmdb::txn &txn, uint64_t connId, const tao::json::value &origJson);
     void ingesterProcessClose(lmdb::txn &txn, uint64_t connId, const tao::json::value &origJson);
     void ingesterProcessNegentropy(lmdb::txn &txn, Decompressor &decomp, uint64_t connId, const tao::json::value &origJson);
@@ -186,17 +238,62 @@ struct RelayServer {
 
     // Utils (can be called by any thread)
 
+    // A websocket thread drains its whole inbox each time it is triggered, so the trigger only
+    // needs to be sent once until then. Saves a write to the eventfd for every message.
+
+    void triggerHub(uint64_t websocketThreadId) {
+        auto &t = hubTriggers[websocketThreadId];
+        if (!t.pending.exchange(true)) t.async->send();
+    }
+
+    // Each connection belongs to one websocket thread, see runWebsocket()
+
+    uint64_t websocketThreadId(uint64_t connId) {
+        return connId % tpWebsocket.numThreads;
+    }
+
+    void dispatchToWebsocket(uint64_t connId, MsgWebsocket &&m) {
+        tpWebsocket.dispatch(connId, std::move(m));
+        triggerHub(websocketThreadId(connId));
+    }
+
+    void notifyDBChange() {
+        uint64_t now = hoytech::curr_time_us();
+
+        if (cfg().relay__monitorSharedBatches) {
+            tpReqMonitor.dispatch(0, MsgReqMonitor{MsgReqMonitor::DBChange{now}}); // the only thread that reads new events
+        } else {
+            tpReqMonitor.dispatchToAll([&]{ return MsgReqMonitor{MsgReqMonitor::DBChange{now}}; });
+        }
+    }
+
     void sendToConn(uint64_t connId, std::string &&payload) {
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(payload)}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::Send{connId, std::move(payload)}});
     }
 
     void sendToConnBinary(uint64_t connId, std::string &&payload) {
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::SendBinary{connId, std::move(payload)}});
-        hubTrigger->send();
+        dispatchToWebsocket(connId, MsgWebsocket{MsgWebsocket::SendBinary{connId, std::move(payload)}});
     }
 
-    void sendEvent(uint64_t connId, const SubId &subId, std::string_view evJson) {
+    // Sends all the items with a single wakeup of each websocket thread involved
+
+    void sendToConnBatch(std::vector<MsgWebsocket::Send> &&items) {
+        if (items.empty()) return;
+
+        if (tpWebsocket.numThreads == 1) {
+            dispatchToWebsocket(0, MsgWebsocket{MsgWebsocket::SendBatch{std::move(items)}});
+            return;
+        }
+
+        std::vector<std::vector<MsgWebsocket::Send>> perThread(tpWebsocket.numThreads);
+        for (auto &item : items) perThread[websocketThreadId(item.connId)].push_back(std::move(item));
+
+        for (size_t i = 0; i < perThread.size(); i++) {
+            if (perThread[i].size()) dispatchToWebsocket(i, MsgWebsocket{MsgWebsocket::SendBatch{std::move(perThread[i])}});
+        }
+    }
+
+    static std::string renderEvent(const SubId &subId, std::string_view evJson) {
         auto subIdSv = subId.sv();
 
         std::string reply;
@@ -208,24 +305,38 @@ struct RelayServer {
         reply += evJson;
         reply += "]";
 
-        sendToConn(connId, std::move(reply));
+        return reply;
     }
 
-    void sendEventToBatch(RecipientList &&list, std::string &&evJson) {
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::SendEventToBatch{std::move(list), std::move(evJson)}});
-        hubTrigger->send();
+    void sendEvent(uint64_t connId, const SubId &subId, std::string_view evJson) {
+        sendToConn(connId, renderEvent(subId, evJson));
+    }
+
+    void sendEventToBatch(RecipientList &&list, EventJson evJson, uint64_t publishedAt = 0) {
+        if (tpWebsocket.numThreads == 1) {
+            dispatchToWebsocket(0, MsgWebsocket{MsgWebsocket::SendEventToBatch{std::move(list), std::move(evJson), publishedAt}});
+            return;
+        }
+
+        std::vector<RecipientList> perThread(tpWebsocket.numThreads);
+        for (auto &r : list) perThread[websocketThreadId(r.connId)].push_back(std::move(r));
+
+        // Only the thread with the most recipients records the latency, so each event is counted once
+        size_t latencyThread = std::max_element(perThread.begin(), perThread.end(), [](const auto &a, const auto &b){ return a.size() < b.size(); }) - perThread.begin();
+
+        for (size_t i = 0; i < perThread.size(); i++) {
+            if (perThread[i].size()) dispatchToWebsocket(i, MsgWebsocket{MsgWebsocket::SendEventToBatch{std::move(perThread[i]), evJson, i == latencyThread ? publishedAt : 0}});
+        }
     }
 
     void sendNoticeError(uint64_t connId, std::string &&payload) {
         LI << "sending error to [" << connId << "]: " << payload;
         auto reply = tao::json::value::array({ "NOTICE", std::string("ERROR: ") + payload });
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
-        hubTrigger->send();
+        sendToConn(connId, tao::json::to_string(reply));
     }
 
     void sendOKResponse(uint64_t connId, std::string_view eventIdHex, bool written, std::string_view message) {
         auto reply = tao::json::value::array({ "OK", eventIdHex, written, message });
-        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::Send{connId, std::move(tao::json::to_string(reply))}});
-        hubTrigger->send();
+        sendToConn(connId, tao::json::to_string(reply));
     }
 };
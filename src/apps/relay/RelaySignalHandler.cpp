@@ -16,8 +16,7 @@ void RelayServer::runSignalHandler() {
         if (s != 0) throw herr("unable to sigwait: ", strerror(errno));
 
         if (sig == SIGUSR1) {
-            tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::GracefulShutdown{}});
-            hubTrigger->send();
+            for (size_t i = 0; i < tpWebsocket.numThreads; i++) dispatchToWebsocket(i, MsgWebsocket{MsgWebsocket::GracefulShutdown{}});
         } else {
             LW << "Got unexpected signal: " << sig;
         }
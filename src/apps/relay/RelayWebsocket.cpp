@@ -1,10 +1,15 @@
 #include "RelayServer.h"
+#include "FrameDeflater.h"
 
 #include "StrfryTemplates.h"
 #include "app_git_version.h"
 
 
 
+// Below this, it's not worth compressing the event separately from the connections' own compression
+static const size_t MIN_PRECOMPRESS_RECIPIENTS = 4;
+
+
 static std::string preGenerateHttpResponse(const std::string &contentType, const std::string &content) {
     std::string output = "HTTP/1.1 200 OK\r\n";
     output += std::string("Content-Type: ") + contentType + "\r\n";
@@ -25,6 +30,11 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
         uint64_t connId;
         uint64_t connectedTimestamp;
         std::string ipAddr;
+        bool compEnabled = false;
+        bool compSlidingWindow = false;
+        uint64_t queuedBytes = 0; // sent to uWS but not yet written to the socket
+        uint64_t pausedAt = 0; // when queuedBytes went above relay.backpressure.highWaterBytes, or 0
+        std::atomic<uint64_t> *totalQueuedBytes;
         struct Stats {
             uint64_t bytesUp = 0;
             uint64_t bytesUpCompressed = 0;
@@ -32,8 +42,8 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
             uint64_t bytesDownCompressed = 0;
         } stats;
 
-        Connection(uWS::WebSocket<uWS::SERVER> *p, uint64_t connId_)
-            : websocket(p), connId(connId_), connectedTimestamp(hoytech::curr_time_us()) { }
+        Connection(uWS::WebSocket<uWS::SERVER> *p, uint64_t connId_, std::atomic<uint64_t> *totalQueuedBytes_)
+            : websocket(p), connId(connId_), connectedTimestamp(hoytech::curr_time_us()), totalQueuedBytes(totalQueuedBytes_) { }
         Connection(const Connection &) = delete;
         Connection(Connection &&) = delete;
     };
@@ -41,12 +51,91 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
     uWS::Hub hub;
     uWS::Group<uWS::SERVER> *hubGroup = nullptr;
     flat_hash_map<uint64_t, Connection*> connIdToConnection;
-    uint64_t nextConnectionId = 1;
     bool gracefulShutdown = false;
 
+    // Each thread listens on the port (REUSE_PORT), and the kernel distributes new connections
+    // between them. So that other threads can tell which thread owns a connection, connIds are
+    // allocated such that connId % numThreads is the thread's id (see websocketThreadId()).
+
+    uint64_t nextConnectionId = tpWebsocket.numThreads + thr.id;
+
+    auto &hubTrigger = hubTriggers[thr.id];
+
+    // Backpressure: when too much has been queued for a slow connection, its REQ scans are paused
+    // until the queue drains, and if it doesn't drain then the connection is closed
+
+    flat_hash_set<Connection*> pausedConns;
+
+    // Called by uWS once a message has been written to the socket. data is the size that was added to queuedBytes.
+    auto sentCb = [](uWS::WebSocket<uWS::SERVER> *webSocket, void *data, bool cancelled, void *reserved){
+        if (cancelled) return; // connection closed, and queuedBytes was accounted for in onDisconnection
+        auto *c = (Connection*)webSocket->getUserData();
+        c->queuedBytes -= (uintptr_t)data;
+        *c->totalQueuedBytes -= (uintptr_t)data;
+    };
+
+    auto addQueued = [&](Connection &c, uint64_t n){
+        c.queuedBytes += n;
+        websocketQueuedBytes += n;
+
+        uint64_t highWater = cfg().relay__backpressure__highWaterBytes;
+
+        if (highWater && !c.pausedAt && c.queuedBytes > highWater) {
+            c.pausedAt = hoytech::curr_time_us();
+            pausedConns.insert(&c);
+            numPausedConns++;
+            tpReqWorker.dispatch(c.connId, MsgReqWorker{MsgReqWorker::PauseConn{c.connId}});
+        }
+    };
+
+    auto unpause = [&](Connection &c){
+        c.pausedAt = 0;
+        pausedConns.erase(&c);
+        numPausedConns--;
+    };
+
+    std::function<void()> backpressureCb = [&]{
+        if (pausedConns.empty()) return;
+
+        uint64_t now = hoytech::curr_time_us();
+        uint64_t maxStuckUs = cfg().relay__backpressure__maxStuckSeconds * 1'000'000;
+        std::vector<Connection*> resumed, stuck;
+
+        for (auto *c : pausedConns) {
+            if (c->queuedBytes <= cfg().relay__backpressure__lowWaterBytes) resumed.push_back(c);
+            else if (maxStuckUs && now - c->pausedAt > maxStuckUs) stuck.push_back(c);
+        }
+
+        for (auto *c : resumed) {
+            unpause(*c);
+            tpReqWorker.dispatch(c->connId, MsgReqWorker{MsgReqWorker::ResumeConn{c->connId}});
+        }
+
+        for (auto *c : stuck) {
+            LI << "[" << c->connId << "] Closing stuck connection with " << renderSize(c->queuedBytes) << " queued";
+            numStuckConnsClosed++;
+            c->websocket->terminate(); // calls onDisconnection
+        }
+    };
+
+    auto checkShutdownComplete = [&]{
+        LI << "Graceful shutdown in progress: " << connIdToConnection.size() << " connections remaining";
+        if (connIdToConnection.size()) return;
+
+        if (++numWebsocketThreadsShutdown == tpWebsocket.numThreads) {
+            LW << "All connections closed, shutting down";
+            ::exit(0);
+        }
+    };
+
     std::string tempBuf;
     tempBuf.reserve(cfg().events__maxEventSize + MAX_SUBID_SIZE + 100);
 
+    // For sending the same compressed event to many connections, see SendEventToBatch below
+    FrameDeflater deflater;
+    std::string compressedBody;
+    flat_hash_map<std::string, uWS::WebSocket<uWS::SERVER>::PreparedMessage*> preparedBySubId;
+
 
     tao::json::value supportedNips = tao::json::value::array({ 1, 2, 4, 9, 11, 12, 16, 20, 22, 28, 33, 40 });
 
@@ -110,9 +199,10 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
     });
 
     hubGroup->onConnection([&](uWS::WebSocket<uWS::SERVER> *ws, uWS::HttpRequest req) {
-        uint64_t connId = nextConnectionId++;
+        uint64_t connId = nextConnectionId;
+        nextConnectionId += tpWebsocket.numThreads;
 
-        Connection *c = new Connection(ws, connId);
+        Connection *c = new Connection(ws, connId, &websocketQueuedBytes);
 
         if (cfg().relay__realIpHeader.size()) {
             auto header = req.getHeader(cfg().relay__realIpHeader.c_str()).toString();
@@ -125,11 +215,10 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
         ws->setUserData((void*)c);
         connIdToConnection.emplace(connId, c);
 
-        bool compEnabled, compSlidingWindow;
-        ws->getCompressionState(compEnabled, compSlidingWindow);
+        ws->getCompressionState(c->compEnabled, c->compSlidingWindow);
         LI << "[" << connId << "] Connect from " << renderIP(c->ipAddr)
-           << " compression=" << (compEnabled ? 'Y' : 'N')
-           << " sliding=" << (compSlidingWindow ? 'Y' : 'N')
+           << " compression=" << (c->compEnabled ? 'Y' : 'N')
+           << " sliding=" << (c->compSlidingWindow ? 'Y' : 'N')
         ;
 
         if (cfg().relay__enableTcpKeepalive) {
@@ -155,16 +244,13 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
 
         tpIngester.dispatch(connId, MsgIngester{MsgIngester::CloseConn{connId}});
 
+        websocketQueuedBytes -= c->queuedBytes;
+        if (c->pausedAt) unpause(*c);
+
         connIdToConnection.erase(connId);
         delete c;
 
-        if (gracefulShutdown) {
-            LI << "Graceful shutdown in progress: " << connIdToConnection.size() << " connections remaining";
-            if (connIdToConnection.size() == 0) {
-                LW << "All connections closed, shutting down";
-                ::exit(0);
-            }
-        }
+        if (gracefulShutdown) checkShutdownComplete();
     });
 
     hubGroup->onMessage2([&](uWS::WebSocket<uWS::SERVER> *ws, char *message, size_t length, uWS::OpCode opCode, size_t compressedSize) {
@@ -178,6 +264,7 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
 
 
     std::function<void()> asyncCb = [&]{
+        hubTrigger.pending = false; // before popping, so messages added after this will send another trigger
         auto newMsgs = thr.inbox.pop_all_no_wait();
 
         auto doSend = [&](uint64_t connId, std::string_view payload, uWS::OpCode opCode){
@@ -186,8 +273,8 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
             auto &c = *it->second;
 
             size_t compressedSize;
-            auto cb = [](uWS::WebSocket<uWS::SERVER> *webSocket, void *data, bool cancelled, void *reserved){};
-            c.websocket->send(payload.data(), payload.size(), opCode, cb, nullptr, true, &compressedSize);
+            addQueued(c, payload.size());
+            c.websocket->send(payload.data(), payload.size(), opCode, sentCb, (void*)(uintptr_t)payload.size(), true, &compressedSize);
             c.stats.bytesUp += payload.size();
             c.stats.bytesUpCompressed += compressedSize;
         };
@@ -197,32 +284,86 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
                 doSend(msg->connId, msg->payload, uWS::OpCode::TEXT);
             } else if (auto msg = std::get_if<MsgWebsocket::SendBinary>(&newMsg.msg)) {
                 doSend(msg->connId, msg->payload, uWS::OpCode::BINARY);
+            } else if (auto msg = std::get_if<MsgWebsocket::SendBatch>(&newMsg.msg)) {
+                for (auto &item : msg->items) doSend(item.connId, item.payload, uWS::OpCode::TEXT);
             } else if (auto msg = std::get_if<MsgWebsocket::SendEventToBatch>(&newMsg.msg)) {
-                tempBuf.reserve(13 + MAX_SUBID_SIZE + msg->evJson.size());
+                const auto &evJson = *msg->evJson;
+
+                tempBuf.reserve(13 + MAX_SUBID_SIZE + evJson.size());
                 tempBuf.resize(10 + MAX_SUBID_SIZE);
                 tempBuf += "\",";
-                tempBuf += msg->evJson;
+                tempBuf += evJson;
                 tempBuf += "]";
 
+                // Connections that have compression without a sliding window compress each message
+                // independently, so they can all be sent the same compressed frame. The event body is
+                // compressed once, and then for each subId the compressed prefix is spliced in front.
+
+                bool precompress = msg->list.size() >= MIN_PRECOMPRESS_RECIPIENTS;
+                compressedBody.clear();
+
                 for (auto &item : msg->list) {
                     auto subIdSv = item.subId.sv();
                     auto *p = tempBuf.data() + MAX_SUBID_SIZE - subIdSv.size();
                     memcpy(p, "[\"EVENT\",\"", 10);
                     memcpy(p + 10, subIdSv.data(), subIdSv.size());
-                    doSend(item.connId, std::string_view(p, 13 + subIdSv.size() + msg->evJson.size()), uWS::OpCode::TEXT);
+                    std::string_view payload(p, 13 + subIdSv.size() + evJson.size());
+
+                    auto it = connIdToConnection.find(item.connId);
+                    if (it == connIdToConnection.end()) continue;
+                    auto &c = *it->second;
+
+                    if (!precompress || !c.compEnabled || c.compSlidingWindow) {
+                        doSend(item.connId, payload, uWS::OpCode::TEXT);
+                        continue;
+                    }
+
+                    auto &prepared = preparedBySubId[subIdSv];
+
+                    if (!prepared) {
+                        if (compressedBody.empty()) {
+                            deflater.compress(std::string_view(tempBuf.data() + MAX_SUBID_SIZE + 12, evJson.size() + 1), compressedBody);
+                            FrameDeflater::removeTrailer(compressedBody);
+                        }
+
+                        std::string frame;
+                        deflater.compress(payload.substr(0, 12 + subIdSv.size()), frame);
+                        frame += compressedBody;
+
+                        prepared = uWS::WebSocket<uWS::SERVER>::prepareMessage(frame.data(), frame.size(), uWS::OpCode::TEXT, true, sentCb);
+                    }
+
+                    addQueued(c, payload.size());
+                    c.websocket->sendPrepared(prepared, (void*)(uintptr_t)payload.size());
+                    c.stats.bytesUp += payload.size();
+                    c.stats.bytesUpCompressed += prepared->length;
                 }
+
+                for (auto &[subId, prepared] : preparedBySubId) uWS::WebSocket<uWS::SERVER>::finalizeMessage(prepared);
+                preparedBySubId.clear();
+
+                if (msg->publishedAt) publishToSendLatency.record(hoytech::curr_time_us() - msg->publishedAt);
             } else if (std::get_if<MsgWebsocket::GracefulShutdown>(&newMsg.msg)) {
                 LW << "Initiating graceful shutdown: " << connIdToConnection.size() << " connections remaining";
                 gracefulShutdown = true;
                 hubGroup->stopListening();
+                if (connIdToConnection.size() == 0) checkShutdownComplete();
             }
         }
     };
 
-    hubTrigger = new uS::Async(hub.getLoop());
-    hubTrigger->setData(&asyncCb);
+    auto *backpressureTimer = new uS::Timer(hub.getLoop());
+    backpressureTimer->setData(&backpressureCb);
+
+    backpressureTimer->start([](uS::Timer *t){
+        auto *r = static_cast<std::function<void()> *>(t->getData());
+        (*r)();
+    }, 100, 100);
+
+    hubTrigger.async = new uS::Async(hub.getLoop());
+    hubTrigger.async->setData(&asyncCb);
 
-    hubTrigger->start([](uS::Async *a){
+    hubTrigger.async->start([](uS::Async *a){
         auto *r = static_cast<std::function<void()> *>(a->data);
         (*r)();
     });
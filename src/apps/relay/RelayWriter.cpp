@@ -37,10 +37,9 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
 
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgWriter::AddEvent>(&newMsg.msg)) {
-                tao::json::value evJson = tao::json::from_string(msg->jsonStr);
                 EventSourceType sourceType = msg->ipAddr.size() == 4 ? EventSourceType::IP4 : EventSourceType::IP6;
                 std::string okMsg;
-                auto res = writePolicy.acceptEvent(evJson, msg->receivedAt, sourceType, msg->ipAddr, okMsg);
+                auto res = writePolicy.acceptEventJson(msg->jsonStr, msg->receivedAt, sourceType, msg->ipAddr, okMsg);
 
                 if (res == WritePolicyResult::Accept) {
                     newEvents.emplace_back(std::move(msg->flatStr), std::move(msg->jsonStr), msg->receivedAt, sourceType, std::move(msg->ipAddr), msg);
@@ -80,6 +79,12 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
             continue;
         }
 
+        // Notify monitors. They are also notified by a file watcher, but only after a delay.
+
+        if (std::any_of(newEvents.begin(), newEvents.end(), [](const auto &e){ return e.status == EventWriteStatus::Written; })) {
+            notifyDBChange();
+        }
+
         // Log
 
         for (auto &newEvent : newEvents) {
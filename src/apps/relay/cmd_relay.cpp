@@ -35,7 +35,9 @@ void RelayServer::run() {
         if (s != 0) throw herr("Unable to set sigmask: ", strerror(errno));
     }
 
-    tpWebsocket.init("Websocket", 1, [this](auto &thr){
+    for (size_t i = 0; i < cfg().relay__numThreads__websocket; i++) hubTriggers.emplace_back();
+
+    tpWebsocket.init("Websocket", cfg().relay__numThreads__websocket, [this](auto &thr){
         runWebsocket(thr);
     });
 
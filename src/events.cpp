@@ -1,17 +1,375 @@
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include <sstream>
 
 #include "events.h"
+#include "IndexStats.h"
+
+
+namespace {
+
+// SAX consumer that fills in a ParsedEvent. Only the fields of the event are copied out: unknown
+// fields (and extra elements of an ["EVENT", ...] message) are skipped over. Like parsing into a
+// tao::json::value, a duplicate key in any object is an error.
+
+struct EventParser {
+    enum class Field { Unknown, Id, Pubkey, CreatedAt, Kind, Tags, Content, Sig };
+
+    ParsedEvent &ev;
+    uint64_t base; // depth of the event object's container: 1 when it is inside an ["EVENT", ...] array
+    uint64_t depth = 0; // number of containers currently open
+    uint64_t skipDepth = 0; // if non-zero, inside an ignored value, which opened this depth
+    uint64_t msgIndex = 0; // element of the ["EVENT", ...] array
+    Field field = Field::Unknown;
+    uint64_t seen = 0; // bit per Field
+    std::vector<std::vector<std::string>> otherKeys; // per open object, keys that aren't event fields
+
+    EventParser(ParsedEvent &ev, bool wrapped) : ev(ev), base(wrapped ? 1 : 0) {
+        ev = ParsedEvent{};
+    }
+
+    void finish() {
+        if (base && msgIndex < 2) throw herr("bad message");
+
+        if (!(seen & bit(Field::Id))) throw herr("missing field: id");
+        if (!(seen & bit(Field::Pubkey))) throw herr("missing field: pubkey");
+        if (!(seen & bit(Field::CreatedAt))) throw herr("missing field: created_at");
+        if (!(seen & bit(Field::Kind))) throw herr("missing field: kind");
+        if (!(seen & bit(Field::Tags))) throw herr("missing field: tags");
+        if (!(seen & bit(Field::Content))) throw herr("missing field: content");
+        if (!(seen & bit(Field::Sig))) throw herr("missing field: sig");
+    }
+
+    static uint64_t bit(Field f) {
+        return 1ULL << (uint64_t)f;
+    }
+
+    bool ignored() {
+        if (skipDepth) return true;
+        if (base && depth == 1 && msgIndex >= 2) return true;
+        if (depth == base + 1 && field == Field::Unknown) return true;
+        return false;
+    }
+
+    void checkScalarAllowed() {
+        if (depth == 0) throw herr(base ? "message is not an array" : "event is not an object");
+        if (base && depth == 1) throw herr(msgIndex == 0 ? "bad message" : "event is not an object");
+        if (depth == base + 2) throw herr("tag is not an array");
+    }
+
+    void string(std::string_view s) {
+        if (ignored()) return;
+
+        if (base && depth == 1 && msgIndex == 0) {
+            if (s != "EVENT") throw herr("not an EVENT message");
+            return;
+        }
+
+        if (depth == base + 3) {
+            ev.tags.back().emplace_back(s);
+            return;
+        }
+
+        checkScalarAllowed();
+
+        if (field == Field::Id) ev.id = s;
+        else if (field == Field::Pubkey) ev.pubkey = s;
+        else if (field == Field::Content) ev.content = s;
+        else if (field == Field::Sig) ev.sig = s;
+        else throw herr("unexpected string");
+    }
+
+    void number(uint64_t n) {
+        if (ignored()) return;
+        checkScalarAllowed();
+
+        if (depth == base + 3) throw herr("tag item is not a string");
+
+        if (field == Field::CreatedAt) ev.created_at = n;
+        else if (field == Field::Kind) ev.kind = n;
+        else throw herr("unexpected number");
+    }
+
+    void number(int64_t n) {
+        if (ignored()) return;
+        if (n < 0) throw herr("unexpected negative number");
+        number(uint64_t(n));
+    }
 
+    void number(double) {
+        if (ignored()) return;
+        throw herr("unexpected non-integer number");
+    }
+
+    void null() {
+        if (ignored()) return;
+        throw herr("unexpected null");
+    }
+
+    void boolean(bool) {
+        if (ignored()) return;
+        throw herr("unexpected boolean");
+    }
+
+    void binary(tao::binary_view) {
+        if (ignored()) return;
+        throw herr("unexpected binary");
+    }
+
+    void begin_array(size_t = 0) {
+        if (ignored()) {
+            if (!skipDepth) skipDepth = depth + 1;
+        } else if (depth == 0) {
+            if (!base) throw herr("event is not an object");
+        } else if (depth == base + 1 && field == Field::Tags) {
+            // tags
+        } else if (depth == base + 2) {
+            if (ev.tags.size() >= cfg().events__maxNumTags) throw herr("too many tags");
+            ev.tags.emplace_back();
+        } else {
+            throw herr("unexpected array");
+        }
+
+        depth++;
+    }
+
+    void element() {
+        if (!skipDepth && base && depth == 1) msgIndex++;
+    }
+
+    void end_array(size_t = 0) {
+        endContainer();
+    }
+
+    void begin_object(size_t = 0) {
+        if (ignored()) {
+            if (!skipDepth) skipDepth = depth + 1;
+        } else if (depth == base && (!base || msgIndex == 1)) {
+            // the event
+        } else if (depth == 0) {
+            throw herr("message is not an array");
+        } else {
+            throw herr("unexpected object");
+        }
+
+        otherKeys.emplace_back();
+        depth++;
+    }
+
+    void key(std::string_view k) {
+        if (skipDepth) {
+            otherKey(k);
+            return;
+        }
+
+        if (k == "id") field = Field::Id;
+        else if (k == "pubkey") field = Field::Pubkey;
+        else if (k == "created_at") field = Field::CreatedAt;
+        else if (k == "kind") field = Field::Kind;
+        else if (k == "tags") field = Field::Tags;
+        else if (k == "content") field = Field::Content;
+        else if (k == "sig") field = Field::Sig;
+        else field = Field::Unknown;
+
+        if (field == Field::Unknown) {
+            otherKey(k);
+            return;
+        }
+
+        if (seen & bit(field)) throw herr("duplicate field: ", k);
+        seen |= bit(field);
+    }
+
+    void otherKey(std::string_view k) {
+        auto &keys = otherKeys.back();
+        if (std::find(keys.begin(), keys.end(), k) != keys.end()) throw herr("duplicate key: ", k);
+        keys.emplace_back(k);
+    }
+
+    void member() {
+    }
+
+    void end_object(size_t = 0) {
+        otherKeys.pop_back();
+        endContainer();
+    }
 
-std::string nostrJsonToFlat(const tao::json::value &v) {
+    void endContainer() {
+        depth--;
+        if (skipDepth > depth) skipDepth = 0;
+    }
+};
+
+
+// Output stream buffer that feeds everything written to it into SHA-256, so that the commitment
+// can be hashed without first being serialised into a string. OpenSSL selects the fastest SHA-256
+// implementation the CPU supports (SHA-NI, AVX2, etc) at runtime.
+
+struct Sha256StreamBuf : public std::streambuf {
+    Sha256StreamBuf() {
+        ctx = EVP_MD_CTX_new();
+        if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr)) throw herr("couldn't init SHA-256");
+        setp(buf, buf + sizeof(buf));
+    }
+
+    ~Sha256StreamBuf() {
+        EVP_MD_CTX_free(ctx);
+    }
+
+    std::string digest() {
+        flushBuf();
+
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        if (!EVP_DigestFinal_ex(ctx, hash, nullptr)) throw herr("couldn't finalise SHA-256");
+
+        return std::string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
+    }
+
+  protected:
+    int_type overflow(int_type ch) override {
+        flushBuf();
+
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        if ((size_t)n < sizeof(buf)) return std::streambuf::xsputn(s, n);
+
+        // Large writes (long content) are hashed in place
+        flushBuf();
+        update(s, n);
+        return n;
+    }
+
+    int sync() override {
+        flushBuf();
+        return 0;
+    }
+
+  private:
+    EVP_MD_CTX *ctx;
+    char buf[4096];
+
+    void update(const char *p, size_t n) {
+        if (n && !EVP_DigestUpdate(ctx, p, n)) throw herr("couldn't update SHA-256");
+    }
+
+    void flushBuf() {
+        update(pbase(), pptr() - pbase());
+        setp(buf, buf + sizeof(buf));
+    }
+};
+
+
+// Emit SAX events for the commitment that is hashed to make the event id: [0,pubkey,created_at,kind,tags,content]
+
+template<typename C>
+void emitTags(C &consumer, const ParsedEvent &ev) {
+    consumer.begin_array(ev.tags.size());
+
+    for (const auto &tag : ev.tags) {
+        consumer.begin_array(tag.size());
+
+        for (const auto &item : tag) {
+            consumer.string(item);
+            consumer.element();
+        }
+
+        consumer.end_array(tag.size());
+        consumer.element();
+    }
+
+    consumer.end_array(ev.tags.size());
+}
+
+template<typename C>
+void emitCommitment(C &consumer, const ParsedEvent &ev) {
+    consumer.begin_array(6);
+
+    consumer.number(uint64_t(0));
+    consumer.element();
+    consumer.string(ev.pubkey);
+    consumer.element();
+    consumer.number(ev.created_at);
+    consumer.element();
+    consumer.number(ev.kind);
+    consumer.element();
+    emitTags(consumer, ev);
+    consumer.element();
+    consumer.string(ev.content);
+    consumer.element();
+
+    consumer.end_array(6);
+}
+
+// Keys in sorted order, as tao::json objects were previously serialised in
+
+template<typename C>
+void emitEvent(C &consumer, const ParsedEvent &ev) {
+    consumer.begin_object(7);
+
+    consumer.key("content");
+    consumer.string(ev.content);
+    consumer.member();
+    consumer.key("created_at");
+    consumer.number(ev.created_at);
+    consumer.member();
+    consumer.key("id");
+    consumer.string(ev.id);
+    consumer.member();
+    consumer.key("kind");
+    consumer.number(ev.kind);
+    consumer.member();
+    consumer.key("pubkey");
+    consumer.string(ev.pubkey);
+    consumer.member();
+    consumer.key("sig");
+    consumer.string(ev.sig);
+    consumer.member();
+    consumer.key("tags");
+    emitTags(consumer, ev);
+    consumer.member();
+
+    consumer.end_object(7);
+}
+
+}
+
+
+void parseEventJson(std::string_view json, ParsedEvent &ev) {
+    EventParser parser(ev, false);
+    tao::json::events::from_string(parser, json);
+    parser.finish();
+}
+
+void parseEventValue(const tao::json::value &json, ParsedEvent &ev) {
+    EventParser parser(ev, false);
+    tao::json::events::from_value(parser, json);
+    parser.finish();
+}
+
+void parseEventMessage(std::string_view msg, ParsedEvent &ev) {
+    EventParser parser(ev, true);
+    tao::json::events::from_string(parser, msg);
+    parser.finish();
+}
+
+
+std::string nostrJsonToFlat(const ParsedEvent &ev) {
     flatbuffers::FlatBufferBuilder builder; // FIXME: pre-allocate size approximately the same as orig JSON?
 
     // Extract values from JSON, add strings to builder
 
-    auto id = from_hex(v.at("id").get_string(), false);
-    auto pubkey = from_hex(v.at("pubkey").get_string(), false);
-    uint64_t created_at = v.at("created_at").get_unsigned();
-    uint64_t kind = v.at("kind").get_unsigned();
+    auto id = from_hex(ev.id, false);
+    auto pubkey = from_hex(ev.pubkey, false);
+    uint64_t created_at = ev.created_at;
+    uint64_t kind = ev.kind;
 
     if (id.size() != 32) throw herr("unexpected id size");
     if (pubkey.size() != 32) throw herr("unexpected pubkey size");
@@ -29,13 +387,12 @@ std::string nostrJsonToFlat(const tao::json::value &v) {
         ));
     }
 
-    if (v.at("tags").get_array().size() > cfg().events__maxNumTags) throw herr("too many tags: ", v.at("tags").get_array().size());
-    for (auto &tagArr : v.at("tags").get_array()) {
-        auto &tag = tagArr.get_array();
+    if (ev.tags.size() > cfg().events__maxNumTags) throw herr("too many tags: ", ev.tags.size());
+    for (auto &tag : ev.tags) {
         if (tag.size() < 1) throw herr("too few fields in tag");
 
-        auto tagName = tag.at(0).get_string();
-        auto tagVal = tag.size() >= 2 ? tag.at(1).get_string() : "";
+        const auto &tagName = tag.at(0);
+        std::string tagVal = tag.size() >= 2 ? tag.at(1) : "";
 
         if (tagName == "e" || tagName == "p") {
             tagVal = from_hex(tagVal, false);
@@ -91,23 +448,21 @@ std::string nostrJsonToFlat(const tao::json::value &v) {
     return std::string(reinterpret_cast<char*>(builder.GetBufferPointer()), builder.GetSize());
 }
 
-std::string nostrHash(const tao::json::value &origJson) {
-    tao::json::value arr = tao::json::empty_array;
-
-    arr.emplace_back(0);
-
-    arr.emplace_back(origJson.at("pubkey"));
-    arr.emplace_back(origJson.at("created_at"));
-    arr.emplace_back(origJson.at("kind"));
-    arr.emplace_back(origJson.at("tags"));
-    arr.emplace_back(origJson.at("content"));
+std::string nostrHash(const ParsedEvent &ev) {
+    Sha256StreamBuf hasher;
+    std::ostream os(&hasher);
 
-    std::string encoded = tao::json::to_string(arr);
+    tao::json::events::to_stream consumer(os);
+    emitCommitment(consumer, ev);
 
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256(reinterpret_cast<unsigned char*>(encoded.data()), encoded.size(), hash);
+    return hasher.digest();
+}
 
-    return std::string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
+std::string normalizedEventJson(const ParsedEvent &ev) {
+    std::ostringstream os;
+    tao::json::events::to_stream consumer(os);
+    emitEvent(consumer, ev);
+    return std::move(os).str();
 }
 
 bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view hash, std::string_view pubkey) {
@@ -127,11 +482,11 @@ bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view ha
     );
 }
 
-void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const tao::json::value &origJson) {
-    auto hash = nostrHash(origJson);
+void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const ParsedEvent &ev) {
+    auto hash = nostrHash(ev);
     if (hash != sv(flat->id())) throw herr("bad event id");
 
-    bool valid = verifySig(secpCtx, from_hex(origJson.at("sig").get_string(), false), sv(flat->id()), sv(flat->pubkey()));
+    bool valid = verifySig(secpCtx, from_hex(ev.sig, false), sv(flat->id()), sv(flat->pubkey()));
     if (!valid) throw herr("bad signature");
 }
 
@@ -156,26 +511,23 @@ void verifyEventTimestamp(const NostrIndex::Event *flat) {
     if (flat->expiration() > 1 && flat->expiration() <= now) throw herr("event expired");
 }
 
-void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr) {
-    flatStr = nostrJsonToFlat(origJson);
+void parseAndVerifyEvent(const ParsedEvent &ev, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr) {
+    flatStr = nostrJsonToFlat(ev);
     auto *flat = flatbuffers::GetRoot<NostrIndex::Event>(flatStr.data());
     if (verifyTime) verifyEventTimestamp(flat);
-    if (verifyMsg) verifyNostrEvent(secpCtx, flat, origJson);
-
-    // Build new object to remove unknown top-level fields from json
-    jsonStr = tao::json::to_string(tao::json::value({
-        { "content", &origJson.at("content") },
-        { "created_at", &origJson.at("created_at") },
-        { "id", &origJson.at("id") },
-        { "kind", &origJson.at("kind") },
-        { "pubkey", &origJson.at("pubkey") },
-        { "sig", &origJson.at("sig") },
-        { "tags", &origJson.at("tags") },
-    }));
+    if (verifyMsg) verifyNostrEvent(secpCtx, flat, ev);
+
+    jsonStr = normalizedEventJson(ev);
 
     if (verifyMsg) verifyNostrEventJsonSize(jsonStr);
 }
 
+void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr) {
+    ParsedEvent ev;
+    parseEventValue(origJson, ev);
+    parseAndVerifyEvent(ev, secpCtx, verifyMsg, verifyTime, flatStr, jsonStr);
+}
+
 
 
 
@@ -255,6 +607,16 @@ std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t lev
 
 
 bool deleteEvent(lmdb::txn &txn, uint64_t levId) {
+    {
+        auto view = env.lookup_Event(txn, levId);
+
+        if (view) {
+            IndexStats::Delta statsDelta(txn);
+            statsDelta.addEvent(view->flat_nested(), -1);
+            statsDelta.apply(txn);
+        }
+    }
+
     bool deleted = env.dbi_EventPayload.del(txn, lmdb::to_sv<uint64_t>(levId));
     env.delete_Event(txn, levId);
     return deleted;
@@ -272,6 +634,7 @@ void writeEvents(lmdb::txn &txn, std::vector<EventToWrite> &evs, uint64_t logLev
 
     std::vector<uint64_t> levIdsToDelete;
     std::string tmpBuf;
+    IndexStats::Delta statsDelta(txn);
 
     for (size_t i = 0; i < evs.size(); i++) {
         auto &ev = evs[i];
@@ -348,6 +711,7 @@ void writeEvents(lmdb::txn &txn, std::vector<EventToWrite> &evs, uint64_t logLev
             env.dbi_EventPayload.put(txn, lmdb::to_sv<uint64_t>(ev.levId), tmpBuf);
 
             ev.status = EventWriteStatus::Written;
+            statsDelta.addEvent(flat, 1);
 
             // Deletions happen after event was written to ensure levIds are not reused
 
@@ -357,4 +721,6 @@ void writeEvents(lmdb::txn &txn, std::vector<EventToWrite> &evs, uint64_t logLev
 
         if (levIdsToDelete.size()) throw herr("unprocessed deletion");
     }
+
+    statsDelta.apply(txn);
 }
@@ -33,14 +33,34 @@ inline bool isEphemeralKind(uint64_t kind) {
 
 
 
-std::string nostrJsonToFlat(const tao::json::value &v);
-std::string nostrHash(const tao::json::value &origJson);
+// The fields of an event, as parsed from its JSON. Unknown top-level fields are dropped.
+
+struct ParsedEvent {
+    std::string id; // hex
+    std::string pubkey; // hex
+    uint64_t created_at = 0;
+    uint64_t kind = 0;
+    std::vector<std::vector<std::string>> tags;
+    std::string content;
+    std::string sig; // hex
+};
+
+// These parse with SAX events, without building a DOM. If they throw, ev may be partially filled in.
+void parseEventJson(std::string_view json, ParsedEvent &ev);
+void parseEventValue(const tao::json::value &json, ParsedEvent &ev);
+void parseEventMessage(std::string_view msg, ParsedEvent &ev); // ["EVENT", {...}]
+
+std::string nostrJsonToFlat(const ParsedEvent &ev);
+std::string nostrHash(const ParsedEvent &ev);
+std::string normalizedEventJson(const ParsedEvent &ev);
 
 bool verifySig(secp256k1_context* ctx, std::string_view sig, std::string_view hash, std::string_view pubkey);
-void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const tao::json::value &origJson);
+
+void verifyNostrEvent(secp256k1_context *secpCtx, const NostrIndex::Event *flat, const ParsedEvent &ev);
 void verifyNostrEventJsonSize(std::string_view jsonStr);
 void verifyEventTimestamp(const NostrIndex::Event *flat);
 
+void parseAndVerifyEvent(const ParsedEvent &ev, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr);
 void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *secpCtx, bool verifyMsg, bool verifyTime, std::string &flatStr, std::string &jsonStr);
 
 
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <endian.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "golpe.h"
 
 
@@ -7,11 +13,11 @@ struct FilterSetBytes {
     struct Item {
         uint16_t offset;
         uint8_t size;
-        uint8_t firstByte;
     };
 
     std::vector<Item> items;
     std::string buf;
+    std::vector<int64_t> keys; // prefixKey() of each item, used to narrow the search before comparing strings
 
     // Sizes are post-hex decode 
 
@@ -31,7 +37,8 @@ struct FilterSetBytes {
 
         for (const auto &item : arr) {
             if (items.size() > 0 && item.starts_with(at(items.size() - 1))) continue; // remove duplicates and redundant prefixes
-            items.emplace_back(Item{ (uint16_t)buf.size(), (uint8_t)item.size(), (uint8_t)item[0] });
+            items.emplace_back(Item{ (uint16_t)buf.size(), (uint8_t)item.size() });
+            keys.push_back(prefixKey(item));
             buf += item;
         }
 
@@ -49,33 +56,88 @@ struct FilterSetBytes {
     }
 
     bool doesMatch(std::string_view candidate) const {
-        // Binary search for upper-bound: https://en.cppreference.com/w/cpp/algorithm/upper_bound
-
-        ssize_t first = 0, last = items.size(), curr;
-        ssize_t count = last - first, step;
-
-        while (count > 0) {
-            curr = first; 
-            step = count / 2;
-            curr += step;
-
-            bool comp = (candidate.size() && items[curr].size && (uint8_t)candidate[0] != items[curr].firstByte)
-                        ? (uint8_t)candidate[0] < items[curr].firstByte
-                        : candidate < std::string_view(buf.data() + items[curr].offset, items[curr].size);
-     
-            if (!comp) {
-                first = ++curr;
+        // Items are sorted and prefix-free, so the only item that can be a prefix of the candidate is
+        // the last one <= candidate. Items whose key is below the candidate's key are known to sort
+        // before it, and items whose key is above it are known to sort after, so strings only need
+        // to be compared for the (usually zero or one) items with an equal key.
+
+        int64_t k = prefixKey(candidate);
+
+        size_t first = keysLowerBound(k);
+        size_t last = first;
+        while (last < keys.size() && keys[last] == k) last++;
+
+        while (first < last && std::string_view(buf.data() + items[first].offset, items[first].size) <= candidate) first++;
+
+        if (first == 0) return false;
+        if (candidate.starts_with(std::string_view(buf.data() + items[first - 1].offset, items[first - 1].size))) return true;
+
+        return false;
+    }
+
+  private:
+    // First 8 bytes, zero-padded and big-endian so integer order matches string order. The sign bit is
+    // flipped so the keys can be compared as signed integers, which is all AVX2 supports for 64-bit lanes.
+
+    static int64_t prefixKey(std::string_view s) {
+        uint64_t v = 0;
+
+        if (s.size() >= 8) {
+            memcpy(&v, s.data(), 8);
+            v = be64toh(v);
+        } else {
+            for (size_t i = 0; i < 8; i++) v = v << 8 | (i < s.size() ? (uint8_t)s[i] : 0);
+        }
+
+        return (int64_t)(v ^ 0x8000'0000'0000'0000ULL);
+    }
+
+    // Below this many keys, a linear count is cheaper than continuing the binary search
+    static const size_t LINEAR_SCAN_KEYS = 32;
+
+    size_t keysLowerBound(int64_t k) const {
+        size_t first = 0, count = keys.size();
+
+        while (count > LINEAR_SCAN_KEYS) {
+            size_t step = count / 2;
+
+            if (keys[first + step] < k) {
+                first += step + 1;
                 count -= step + 1;
             } else {
                 count = step;
             }
         }
 
-        if (first == 0) return false;
-        if (candidate.starts_with(std::string_view(buf.data() + items[first - 1].offset, items[first - 1].size))) return true;
+#if defined(__x86_64__)
+        static const bool haveAvx2 = __builtin_cpu_supports("avx2");
+        if (haveAvx2) return first + countLessAvx2(keys.data() + first, count, k);
+#endif
 
-        return false;
+        return first + countLessScalar(keys.data() + first, count, k);
+    }
+
+    static size_t countLessScalar(const int64_t *p, size_t n, int64_t k) {
+        size_t output = 0;
+        for (size_t i = 0; i < n; i++) output += p[i] < k;
+        return output;
     }
+
+#if defined(__x86_64__)
+    __attribute__((target("avx2")))
+    static size_t countLessAvx2(const int64_t *p, size_t n, int64_t k) {
+        __m256i kv = _mm256_set1_epi64x(k);
+        size_t output = 0, i = 0;
+
+        for (; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i lt = _mm256_cmpgt_epi64(kv, v);
+            output += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+        }
+
+        return output + countLessScalar(p + i, n - i, k);
+    }
+#endif
 };
 
 struct FilterSetUint {
@@ -105,6 +167,61 @@ struct FilterSetUint {
     }
 };
 
+// An event's tags sorted by tag letter, so a filter can find the values for each of its tags
+// with a binary search instead of walking every tag of the event. Built once per event and
+// shared by all the filters being checked against it.
+
+struct EventTagIndex {
+    struct Entry {
+        uint8_t key;
+        std::string_view val;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t present[4] = {}; // bitmap of tag letters that appear in the event
+
+    EventTagIndex() {}
+
+    explicit EventTagIndex(const NostrIndex::Event *ev) {
+        build(ev);
+    }
+
+    const EventTagIndex &build(const NostrIndex::Event *ev) {
+        entries.clear();
+        for (auto &p : present) p = 0;
+
+        entries.reserve(ev->tagsFixed32()->size() + ev->tagsGeneral()->size());
+
+        auto add = [&](uint8_t key, std::string_view val){
+            entries.emplace_back(Entry{ key, val });
+            present[key >> 6] |= 1ULL << (key & 63);
+        };
+
+        for (const auto &tagPair : *(ev->tagsFixed32())) add(tagPair->key(), sv(tagPair->val()));
+        for (const auto &tagPair : *(ev->tagsGeneral())) add(tagPair->key(), sv(tagPair->val()));
+
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b){ return a.key < b.key; });
+
+        return *this;
+    }
+
+    bool hasKey(uint8_t key) const {
+        return present[key >> 6] & (1ULL << (key & 63));
+    }
+
+    bool anyMatch(uint8_t key, const FilterSetBytes &filt) const {
+        if (!hasKey(key)) return false;
+
+        auto it = std::lower_bound(entries.begin(), entries.end(), key, [](const Entry &e, uint8_t k){ return e.key < k; });
+
+        for (; it != entries.end() && it->key == key; ++it) {
+            if (filt.doesMatch(it->val)) return true;
+        }
+
+        return false;
+    }
+};
+
 struct NostrFilter {
     std::optional<FilterSetBytes> ids;
     std::optional<FilterSetBytes> authors;
@@ -159,8 +276,6 @@ struct NostrFilter {
             }
         }
 
-        if (tags.size() > 2) throw herr("too many tags in filter"); // O(N^2) in matching, just prohibit it
-
         if (limit > maxFilterLimit) limit = maxFilterLimit;
 
         indexOnlyScans = (numMajorFields <= 1) || (numMajorFields == 2 && authors && kinds);
@@ -172,7 +287,8 @@ struct NostrFilter {
         return true;
     }
 
-    bool doesMatch(const NostrIndex::Event *ev) const {
+    // Everything except tags
+    bool doesMatchFields(const NostrIndex::Event *ev) const {
         if (neverMatch) return false;
 
         if (!doesMatchTimes(ev->created_at())) return false;
@@ -181,31 +297,67 @@ struct NostrFilter {
         if (authors && !authors->doesMatch(sv(ev->pubkey()))) return false;
         if (kinds && !kinds->doesMatch(ev->kind())) return false;
 
+        return true;
+    }
+
+    bool doesMatchTags(const EventTagIndex &evTags) const {
         for (const auto &[tag, filt] : tags) {
-            bool foundMatch = false;
+            if (!evTags.anyMatch((uint8_t)tag, filt)) return false;
+        }
 
-            for (const auto &tagPair : *(ev->tagsFixed32())) {
-                auto eventTag = tagPair->key();
-                if (eventTag == tag && filt.doesMatch(sv(tagPair->val()))) {
-                    foundMatch = true;
-                    break;
-                }
-            }
+        return true;
+    }
 
-            if (!foundMatch) {
-                for (const auto &tagPair : *(ev->tagsGeneral())) {
-                    auto eventTag = tagPair->key();
-                    if (eventTag == tag && filt.doesMatch(sv(tagPair->val()))) {
-                        foundMatch = true;
-                        break;
-                    }
-                }
-            }
+    // evTags must have been built from ev, unless this filter has no tags
+    bool doesMatch(const NostrIndex::Event *ev, const EventTagIndex &evTags) const {
+        return doesMatchFields(ev) && doesMatchTags(evTags);
+    }
+
+    bool doesMatch(const NostrIndex::Event *ev) const {
+        if (!doesMatchFields(ev)) return false;
+        if (tags.empty()) return true;
+        return doesMatchTags(EventTagIndex(ev));
+    }
+
+    // Equal for filters that match the same events with the same limit, regardless of the
+    // order of their fields and items in the JSON (items are already sorted and de-duplicated)
+
+    std::string canonicalKey() const {
+        std::string output;
 
-            if (!foundMatch) return false;
+        auto addUint = [&](uint64_t n){ output += lmdb::to_sv<uint64_t>(n); };
+
+        auto addSet = [&](char name, const FilterSetBytes &set){
+            output += name;
+            addUint(set.size());
+            for (const auto &item : set.items) output += (char)item.size;
+            output += set.buf;
+        };
+
+        if (ids) addSet('i', *ids);
+        if (authors) addSet('a', *authors);
+
+        if (kinds) {
+            output += 'k';
+            addUint(kinds->size());
+            for (auto kind : kinds->items) addUint(kind);
         }
 
-        return true;
+        std::vector<char> tagNames;
+        for (const auto &[tagName, filterSet] : tags) tagNames.push_back(tagName);
+        std::sort(tagNames.begin(), tagNames.end());
+
+        for (auto tagName : tagNames) {
+            output += '#';
+            addSet(tagName, tags.at(tagName));
+        }
+
+        output += 't';
+        addUint(since);
+        addUint(until);
+        addUint(limit);
+
+        return output;
     }
 };
 
@@ -241,8 +393,14 @@ struct NostrFilterGroup {
     }
 
     bool doesMatch(const NostrIndex::Event *ev) const {
+        std::optional<EventTagIndex> evTags; // built on first use
+
         for (const auto &f : filters) {
-            if (f.doesMatch(ev)) return true;
+            if (!f.doesMatchFields(ev)) continue;
+            if (f.tags.empty()) return true;
+
+            if (!evTags) evTags.emplace(ev);
+            if (f.doesMatchTags(*evTags)) return true;
         }
 
         return false;
@@ -251,4 +409,20 @@ struct NostrFilterGroup {
     size_t size() const {
         return filters.size();
     }
+
+    // Filters are sorted since the results of a group don't depend on their order
+    std::string canonicalKey() const {
+        std::vector<std::string> keys;
+        for (const auto &f : filters) keys.emplace_back(f.canonicalKey());
+        std::sort(keys.begin(), keys.end());
+
+        std::string output;
+
+        for (const auto &k : keys) {
+            output += lmdb::to_sv<uint64_t>(k.size());
+            output += k;
+        }
+
+        return output;
+    }
 };
@@ -5,6 +5,40 @@
 
 #include "golpe.h"
 
+#include "IndexStats.h"
+
+
+// Version 3 added the tagKind index. Entries that the previous binary may have added without a
+// version bump are cleared, and the index is rebuilt from the stored events.
+
+static void migrateToVersion3(lmdb::txn &txn) {
+    LI << "DB migration: building tagKind index, this may take a while...";
+
+    {
+        auto cursor = lmdb::cursor::open(txn, env.dbi_Event__tagKind);
+        std::string_view k, v;
+        while (cursor.get(k, v, MDB_FIRST)) cursor.del();
+    }
+
+    uint64_t numEvents = 0;
+
+    env.foreach_Event(txn, [&](auto &ev){
+        auto *flat = ev.flat_nested();
+        auto levId = lmdb::to_sv<uint64_t>(ev.primaryKeyId);
+
+        auto add = [&](char tagName, std::string_view tagVal){
+            env.dbi_Event__tagKind.put(txn, makeKey_StringUint64Uint64(std::string(1, tagName) + std::string(tagVal), flat->kind(), flat->created_at()), levId);
+        };
+
+        for (const auto &tagPair : *(flat->tagsGeneral())) add((char)tagPair->key(), sv(tagPair->val()));
+        for (const auto &tagPair : *(flat->tagsFixed32())) add((char)tagPair->key(), sv(tagPair->val()));
+
+        numEvents++;
+        return true;
+    });
+
+    LI << "DB migration: tagKind index built for " << numEvents << " events";
+}
 
 static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
     auto dbTooOld = [&](uint64_t ver) {
@@ -44,6 +78,13 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
 
     if (s->dbVersion() < CURR_DB_VERSION) {
         if (cmd == "export" || cmd == "info") return;
+
+        if (s->dbVersion() == 2) {
+            migrateToVersion3(txn);
+            env.update_Meta(txn, *s, { .dbVersion = 3 });
+            return;
+        }
+
         dbTooOld(s->dbVersion());
     }
 
@@ -69,5 +110,9 @@ static void setRLimits() {
 void onAppStartup(lmdb::txn &txn, const std::string &cmd) {
     dbCheck(txn, cmd);
 
+    if (cmd != "export" && cmd != "info") {
+        IndexStats::check(txn);
+    }
+
     setRLimits();
 }
@@ -0,0 +1,189 @@
+#!/usr/bin/env perl
+
+# Benchmarks against the events in the current DB. Run from the root of the project.
+# To compare two builds, point STRFRY at the other binary:
+#
+#     STRFRY=/path/to/old/strfry perl test/bench.pl filter
+
+use strict;
+use JSON::XS;
+use IPC::Open2;
+use Time::HiRes qw(time);
+
+
+my $strfry = $ENV{STRFRY} || './strfry';
+
+
+sub getPubkeys {
+    my $n = shift;
+
+    my %seen;
+    my @out;
+
+    open(my $fh, '-|', "$strfry export --reverse 2>/dev/null") || die "couldn't run export: $!";
+
+    while (<$fh>) {
+        my $ev = decode_json($_);
+        next if $seen{$ev->{pubkey}}++;
+        push @out, $ev->{pubkey};
+        last if @out >= $n;
+    }
+
+    close($fh);
+
+    return \@out;
+}
+
+sub timeMonitor {
+    my $cmds = shift;
+
+    my $start = time();
+
+    my $pid = open2(my $outfile, my $infile, "$strfry monitor | wc -l");
+    for my $c (@$cmds) { print $infile encode_json($c), "\n"; }
+    close($infile);
+
+    my $count = <$outfile>;
+    chomp $count;
+
+    waitpid($pid, 0);
+    die "monitor cmd died" if $? >> 8;
+
+    return (time() - $start, $count);
+}
+
+
+## Large author lists: every event from one of the authors is checked against every sub,
+## so this is dominated by FilterSetBytes::doesMatch. NUM_AUTHORS and NUM_SUBS can be set in env.
+
+sub benchFilter {
+    my $numAuthors = $ENV{NUM_AUTHORS} || 1000;
+    my $numSubs = $ENV{NUM_SUBS} || 100;
+
+    my $pubkeys = getPubkeys($numAuthors);
+    print "Using ", scalar(@$pubkeys), " authors, $numSubs subs\n";
+
+    my @cmds;
+
+    for my $i (1..$numSubs) {
+        push @cmds, ["sub", $i, "s", { authors => $pubkeys }];
+    }
+
+    push @cmds, ["interest", 1, "s"];
+
+    my ($elapsed, $count) = timeMonitor(\@cmds);
+
+    printf "filter: %.3fs, %d events matched\n", $elapsed, $count;
+}
+
+
+## Many small subscriptions of the kinds clients typically make, with every event in the DB replayed
+## through the monitor engine. Measures per-event matching overhead. NUM_SUBS can be set in env.
+
+sub benchMonitor {
+    my $numSubs = $ENV{NUM_SUBS} || 10000;
+
+    my $pubkeys = getPubkeys(1000);
+    die "no events in DB" if !@$pubkeys;
+    print "Using $numSubs subs\n";
+
+    srand(1);
+    my $pick = sub { $pubkeys->[int(rand(@$pubkeys))] };
+
+    my @cmds;
+
+    for my $i (1..$numSubs) {
+        my $type = $i % 4;
+        my $filter;
+
+        if ($type == 0) {
+            $filter = { authors => [ map { $pick->() } 1..20 ] };
+        } elsif ($type == 1) {
+            $filter = { authors => [ map { $pick->() } 1..20 ], kinds => [1, 6, 7] };
+        } elsif ($type == 2) {
+            $filter = { '#p' => [ $pick->() ], kinds => [1, 7] };
+        } else {
+            $filter = { kinds => [0, 3], authors => [ $pick->() ] };
+        }
+
+        push @cmds, ["sub", 1 + int($i / 10), "s$i", $filter];
+    }
+
+    push @cmds, ["interest", 1, "s1"];
+
+    my ($elapsed, $count) = timeMonitor(\@cmds);
+
+    printf "monitor: %.3fs, %d events matched\n", $elapsed, $count;
+}
+
+
+## DB scans over many authors, which merge the results of one cursor per author.
+## NUM_AUTHORS and LIMIT can be set in env.
+
+sub benchScan {
+    my $numAuthors = $ENV{NUM_AUTHORS} || 1000;
+    my $limit = $ENV{LIMIT} || 500;
+
+    my $pubkeys = getPubkeys($numAuthors);
+    print "Using ", scalar(@$pubkeys), " authors, limit $limit\n";
+
+    for my $filter ({ authors => $pubkeys, limit => 0+$limit }, { authors => $pubkeys }) {
+        my $fge = encode_json($filter);
+
+        my $start = time();
+
+        open(my $fh, '-|', $strfry, 'scan', '--metrics', '--count', $fge) || die "couldn't run scan: $!";
+        my $count = <$fh>;
+        close($fh);
+        chomp $count;
+
+        printf "scan %s: %.3fs, %d events\n", ($filter->{limit} ? "limit=$limit" : "no limit"), time() - $start, $count;
+    }
+}
+
+
+## Events from the current DB imported into a scratch DB (the one in test/strfry.conf), with and without
+## signature verification, for each number of import threads. NUM_EVENTS and THREADS (comma-separated)
+## can be set in env.
+
+sub benchImport {
+    my $numEvents = $ENV{NUM_EVENTS} || 100000;
+    my @threads = split /,/, ($ENV{THREADS} || "1,4");
+
+    my $file = "/tmp/strfry-bench-import.jsonl";
+    system("$strfry export --reverse 2>/dev/null | head -n $numEvents > $file") == 0 || die "couldn't export";
+
+    my $count = `wc -l < $file`;
+    chomp $count;
+    die "no events in DB" if !$count;
+    print "Using $count events\n";
+
+    for my $threads (@threads) {
+        for my $verify (1, 0) {
+            system("mkdir -p strfry-db-test");
+            system("rm -f strfry-db-test/data.mdb");
+
+            my $start = time();
+            system("$strfry --config test/strfry.conf import --threads=$threads " . ($verify ? "" : "--no-verify") . " < $file 2>/dev/null") == 0 || die "import failed";
+            my $elapsed = time() - $start;
+
+            printf "import threads=%d %s: %.3fs, %d events/sec\n", $threads, ($verify ? "verify" : "no-verify"), $elapsed, $count / $elapsed;
+        }
+    }
+
+    unlink($file);
+}
+
+my $cmd = shift || die "need cmd";
+
+if ($cmd eq 'filter') {
+    benchFilter();
+} elsif ($cmd eq 'monitor') {
+    benchMonitor();
+} elsif ($cmd eq 'scan') {
+    benchScan();
+} elsif ($cmd eq 'import') {
+    benchImport();
+} else {
+    die "unknown cmd: $cmd";
+}
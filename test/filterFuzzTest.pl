@@ -174,6 +174,42 @@ sub genRandomFilterGroup {
     return \@filters;
 }
 
+# A short author prefix combined with a tag or kinds, so that DBScan has a choice of indices to
+# intersect and one of them walks several keys
+
+sub genPrefixIntersectFilter {
+    my $f = {};
+
+    $f->{authors} = [];
+    for (0..(rand()*3)) {
+        my $pubkey = $pubkeys->[int(rand() * @$pubkeys)];
+        push @{$f->{authors}}, substr($pubkey, 0, (int(rand() * 2) + 1) * 2);
+    }
+
+    if (rand() < .5) {
+        $f->{kinds} = [];
+        for (0..(rand()*3)) {
+            push @{$f->{kinds}}, 0+$kinds->[int(rand() * @$kinds)];
+        }
+    }
+
+    if (!$f->{kinds} || rand() < .5) {
+        if (rand() < .5) {
+            $f->{'#t'} = [];
+            for (0..(rand()*3)) {
+                push @{$f->{'#t'}}, $topics->[int(rand() * @$topics)];
+            }
+        } else {
+            $f->{'#p'} = [];
+            for (0..(rand()*3)) {
+                push @{$f->{'#p'}}, $pubkeys->[int(rand() * @$pubkeys)];
+            }
+        }
+    }
+
+    return [$f];
+}
+
 sub randPrefix {
     my $v = shift;
     my $noPrefix = shift;
@@ -229,6 +265,27 @@ sub testScan {
 }
 
 
+sub testCache {
+    my $fg = shift;
+    my $behind = shift;
+    my $fge = encode_json($fg);
+
+    print "$fge (behind $behind)\n";
+
+    my $resA = `./strfry scan '$fge' | jq -r .id | sort | sha256sum`;
+    my $resB = `./strfry scan --via-cache $behind '$fge' | jq -r .id | sort | sha256sum`;
+
+    print "$resA\n$resB\n";
+
+    if ($resA ne $resB) {
+        print STDERR "$fge (behind $behind)\n";
+        die "MISMATCH";
+    }
+
+    print "-----------MATCH OK-------------\n\n\n";
+}
+
+
 sub testMonitor {
     my $monCmds = shift;
     my $interestFg = shift;
@@ -276,6 +333,17 @@ if ($cmd eq 'scan') {
         my $fg = genRandomFilterGroup(1);
         testScan($fg);
     }
+} elsif ($cmd eq 'scan-intersect') {
+    while (1) {
+        my $fg = genPrefixIntersectFilter();
+        testScan($fg);
+    }
+} elsif ($cmd eq 'scan-cache') {
+    while (1) {
+        # Several filters with limits, so that the cache has to keep each filter's results separately
+        my $fg = [ map { @{ genRandomFilterGroup(1) } } (0..(rand()*3)) ];
+        testCache($fg, int(rand() * 5000));
+    }
 } elsif ($cmd eq 'monitor') {
     while (1) {
         my ($monCmds, $interestFg) = genRandomMonitorCmds();
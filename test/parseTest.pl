@@ -0,0 +1,157 @@
+#!/usr/bin/env perl
+
+use strict;
+
+use Carp;
+$SIG{ __DIE__ } = \&Carp::confess;
+
+use JSON::XS;
+
+
+# Checks that the SAX parser used by import and the relay gives the same results as parsing into a
+# tao::json::value first: the same ids and normalised JSON for accepted events, and the same events
+# rejected (the reasons can differ). See "strfry verify".
+
+my $sec = 'c1eee22f68dc218d98263cfecb350db6fc6b3e836b47423b66c62af7ae3e32bb';
+
+my $json = JSON::XS->new->utf8->canonical;
+my $jsonNonRef = JSON::XS->new->utf8->allow_nonref;
+
+
+my $plain = genEvent('--content', 'hi', '--kind', 1);
+my $escapes = genEvent('--content', qq{quote " backslash \\ slash / newline \n tab \t end}, '--kind', 1);
+my $unicode = genEvent('--content', "caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac \xf0\x9f\x98\x80", '--kind', 1, '--tag', 't', "\xe6\x97\xa5\xe6\x9c\xac");
+my $tags = genEvent('--content', 'tagged', '--kind', 30001, '--tag', 'd', 'myrepl', '--tag', 'expiration', '4000000000', '-e', 'cc49e2a58373abc226eee84bee9ba954615aa2ef1563c4f955a74c4606a3b1fa');
+
+
+my $eventCases = [
+    { desc => "plain", line => $plain, ok => 1, },
+    { desc => "escapes in content", line => $escapes, ok => 1, },
+    { desc => "unicode in content and tags", line => $unicode, ok => 1, },
+    { desc => "tags", line => $tags, ok => 1, },
+
+    { desc => "unicode as \\u escapes", line => JSON::XS->new->ascii->canonical->encode($json->decode($unicode)), ok => 1, },
+    { desc => "escaped slash", line => ($escapes =~ s{/}{\\/}gr), ok => 1, },
+    { desc => "whitespace", line => ($plain =~ s/([{,:])/$1 \t /gr), ok => 1, },
+    { desc => "different key order", line => reorder($plain), ok => 1, },
+
+    { desc => "extra fields", line => modify($plain, sub { $_[0]->{extra} = { a => [1, 2.5, { b => undef }], c => \1 }; $_[0]->{seen_on} = 'x'; }), ok => 1, },
+    { desc => "same key in different objects", line => addRaw($plain, '"x":{"a":1},"y":{"a":[{"a":2}]},"a":3,'), ok => 1, },
+
+    { desc => "duplicate field", line => addRaw($plain, '"kind":1,'), ok => 0, },
+    { desc => "duplicate unknown field", line => addRaw($plain, '"x":1,"x":2,'), ok => 0, },
+    { desc => "duplicate key inside unknown field", line => addRaw($plain, '"x":{"a":1,"a":2},'), ok => 0, },
+
+    { desc => "number in tag", line => modify($plain, sub { $_[0]->{tags} = [["t", 5]] }), ok => 0, },
+    { desc => "tag is not an array", line => modify($plain, sub { $_[0]->{tags} = ["t"] }), ok => 0, },
+    { desc => "kind is a string", line => modify($plain, sub { $_[0]->{kind} = "1" }), ok => 0, },
+    { desc => "kind is not an integer", line => ($plain =~ s{"kind":1,}{"kind":1.0,}r), ok => 0, },
+    { desc => "negative created_at", line => modify($plain, sub { $_[0]->{created_at} = -1 }), ok => 0, },
+    { desc => "null content", line => modify($plain, sub { $_[0]->{content} = undef }), ok => 0, },
+    { desc => "missing field", line => modify($plain, sub { delete $_[0]->{sig} }), ok => 0, },
+    { desc => "bad id", line => modify($plain, sub { $_[0]->{content} = 'changed' }), ok => 0, okNoVerify => 1, },
+
+    { desc => "not an object", line => '[]', ok => 0, },
+    { desc => "string", line => '"hi"', ok => 0, },
+    { desc => "empty object", line => '{}', ok => 0, },
+    { desc => "invalid JSON", line => substr($plain, 0, 50), ok => 0, },
+    { desc => "trailing garbage", line => "$plain x", ok => 0, },
+];
+
+my $messageCases = [
+    { desc => "EVENT message", line => qq{["EVENT",$plain]}, ok => 1, },
+    { desc => "EVENT message with whitespace", line => qq{[ \t"EVENT" , \t$unicode ]}, ok => 1, },
+    { desc => "EVENT message with extra elements", line => qq{["EVENT",$plain,"x",{"a":[1]}]}, ok => 1, },
+    { desc => "EVENT message with duplicate key in extra element", line => qq{["EVENT",$plain,{"a":1,"a":2}]}, ok => 0, },
+    { desc => "EVENT message with escaped command", line => qq{["\\u0045VENT",$plain]}, ok => 1, },
+    { desc => "EVENT message with extra fields", line => '["EVENT",' . modify($plain, sub { $_[0]->{extra} = [{}] }) . ']', ok => 1, },
+    { desc => "EVENT message with duplicate field", line => '["EVENT",' . addRaw($plain, '"content":"x",') . ']', ok => 0, },
+    { desc => "missing event", line => '["EVENT"]', ok => 0, },
+    { desc => "event is not an object", line => '["EVENT",[]]', ok => 0, },
+    { desc => "not an EVENT message", line => qq{["REQ",$plain]}, ok => 0, },
+    { desc => "not an array", line => qq{{"EVENT":$plain}}, ok => 0, },
+];
+
+
+for my $noVerify (0, 1) {
+    print "* events", ($noVerify ? " (--no-verify)" : ""), "\n";
+    runCases($eventCases, $noVerify, 0);
+
+    print "* messages", ($noVerify ? " (--no-verify)" : ""), "\n";
+    runCases($messageCases, $noVerify, 1);
+}
+
+print "\nOK\n";
+
+
+
+sub runCases {
+    my ($cases, $noVerify, $message) = @_;
+
+    my $opts = '';
+    $opts .= ' --no-verify' if $noVerify;
+    $opts .= ' --message' if $message;
+
+    my $sax = verify($cases, $opts);
+    my $value = verify($cases, "$opts --via-value");
+
+    for (my $i = 0; $i < @$cases; $i++) {
+        my $c = $cases->[$i];
+
+        my $expected = $noVerify && exists $c->{okNoVerify} ? $c->{okNoVerify} : $c->{ok};
+        my $ok = $sax->[$i] !~ /^rejected:/;
+
+        die "$c->{desc}: expected " . ($expected ? "accepted" : "rejected") . ", got: $sax->[$i]" if $ok != $expected;
+
+        if ($ok) {
+            die "$c->{desc}: mismatch:\n  sax:   $sax->[$i]\n  value: $value->[$i]" if $sax->[$i] ne $value->[$i];
+        } else {
+            die "$c->{desc}: rejected by SAX parser but not via value: $value->[$i]" if $value->[$i] !~ /^rejected:/;
+        }
+    }
+}
+
+sub verify {
+    my ($cases, $opts) = @_;
+
+    open(my $fh, '>', 'test-parseXYZ.jsonl') || die "$!";
+    print $fh "$_->{line}\n" for @$cases;
+    close($fh);
+
+    my @output = `./strfry --config test/strfry.conf verify $opts <test-parseXYZ.jsonl 2>/dev/null`;
+    die "strfry verify failed" if $?;
+    chomp for @output;
+
+    system("rm test-parseXYZ.jsonl");
+
+    die "incorrect number of results" if @output != @$cases;
+
+    return \@output;
+}
+
+
+sub genEvent {
+    open(my $fh, '-|', 'nostril', '--sec', $sec, '--created-at', 5000, @_) || die "$!";
+    my $ev = do { local $/; <$fh> };
+    close($fh) || die "nostril failed";
+
+    return $json->encode($json->decode($ev)); # canonical, so the text can be edited predictably
+}
+
+sub modify {
+    my ($line, $cb) = @_;
+    my $ev = $json->decode($line);
+    $cb->($ev);
+    return $json->encode($ev);
+}
+
+sub addRaw {
+    my ($line, $raw) = @_;
+    return $line =~ s/^\{/{$raw/r;
+}
+
+sub reorder {
+    my $line = shift;
+    my $ev = $json->decode($line);
+    return '{' . join(',', map { $jsonNonRef->encode($_) . ':' . $jsonNonRef->encode($ev->{$_}) } reverse sort keys %$ev) . '}';
+}
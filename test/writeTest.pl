@@ -10,6 +10,13 @@ use JSON::XS;
 
 $Data::Dumper::Sortkeys = 1;
 
+# With "bulk", the events of each test are also loaded into an empty DB with import --bulk, which
+# must end up with the same events as the incremental import. The bulk loader's result doesn't
+# depend on input order, so tests where the incremental result does must set bulkSkip.
+
+my $mode = shift // '';
+die "unknown mode: $mode" if $mode ne '' && $mode ne 'bulk';
+
 
 my $ids = [
     {
@@ -237,30 +244,54 @@ sub doTest {
     cleanDb();
 
     my $eventIds = [];
+    my $eventJsons = [];
 
     for my $ev (@{ $spec->{events} }) {
         $ev =~ s{EV_(\d+)}{$eventIds->[$1]}eg;
-        push @$eventIds, addEvent($ev);
+        my ($id, $json) = addEvent($ev);
+        push @$eventIds, $id;
+        push @$eventJsons, $json;
     }
 
     for (my $i = 0; $i < @{ $spec->{assertIds} || [] }; $i++) {
         die "assertId incorrect" unless rindex($eventIds->[$i], $spec->{assertIds}->[$i], 0) == 0;
     }
 
-    my $finalEventIds = [];
-
-    {
-        open(my $fh, '-|', './strfry --config test/strfry.conf export 2>/dev/null') || die "$!";
-        while(<$fh>) {
-            push @$finalEventIds, decode_json($_)->{id};
-        }
-    }
+    my $finalEventIds = exportIds();
 
     die "incorrect eventIds lengths" if @{$spec->{verify}} != @$finalEventIds;
 
     for (my $i = 0; $i < @$finalEventIds; $i++) {
         die "id mismatch" if $eventIds->[$spec->{verify}->[$i]] ne $finalEventIds->[$i];
     }
+
+    if ($mode eq 'bulk' && !$spec->{bulkSkip}) {
+        my $expected = join(',', sort @$finalEventIds);
+
+        # A 1 byte sort buffer puts every event in its own sorted run, to exercise merging them
+        for my $sortBuffer ('', '--bulk-sort-buffer=1') {
+            cleanDb();
+
+            open(my $fh, '|-', "./strfry --config test/strfry.conf import --bulk $sortBuffer 2>/dev/null") || die "$!";
+            print $fh "$_\n" for @$eventJsons; # blank lines are skipped
+            close($fh) || die "bulk import failed";
+
+            my $bulkEventIds = join(',', sort @{ exportIds() });
+            die "bulk import mismatch ($sortBuffer): $bulkEventIds vs $expected" if $bulkEventIds ne $expected;
+        }
+    }
+}
+
+
+sub exportIds {
+    my $ids = [];
+
+    open(my $fh, '-|', './strfry --config test/strfry.conf export 2>/dev/null') || die "$!";
+    while(<$fh>) {
+        push @$ids, decode_json($_)->{id};
+    }
+
+    return $ids;
 }
 
 
@@ -283,5 +314,5 @@ sub addEvent {
     my $event = decode_json($eventJson);
     print Dumper($event) if $ENV{DUMP_EVENTS};
 
-    return $event->{id};
+    return ($event->{id}, $eventJson);
 }